@@ -0,0 +1,420 @@
+// Drives ConnectionTable with synthetic conntrack events and measures the
+// event and export paths. Needs no privileges and no live netlink socket:
+// events are built with nfct_new()/nfct_set_attr*() and fed to the table
+// directly.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <argagg/argagg.hpp>
+#include <prometheus/text_serializer.h>
+
+#include "connection_table.h"
+#include "connection_metrics.h"
+
+using namespace std;
+using namespace conntrackex;
+
+typedef chrono::steady_clock Clock;
+
+// Connection i goes from local address 10.1.<i / 65536>.1, port i % 65536,
+// to port 443 of remote host (i % hosts), so keys are unique for up to 16M
+// connections and the host label cardinality is exactly `hosts`. With a
+// drift, the range of hosts new connections go to moves up by one every
+// `drift` connections, so hosts keep appearing and disappearing:
+struct SyntheticEvents
+{
+    SyntheticEvents(size_t hosts) : hosts(hosts), ct(nfct_new())
+    {
+        nfct_set_attr_u8(this->ct, ATTR_L3PROTO, AF_INET);
+        nfct_set_attr_u8(this->ct, ATTR_L4PROTO, IPPROTO_TCP);
+    }
+
+    ~SyntheticEvents() { nfct_destroy(this->ct); }
+
+    static uint32_t localAddress(size_t id) { return htonl((10u << 24) | (1u << 16) | (((id >> 16) & 0xFF) << 8) | 1); }
+
+    size_t getHost(size_t id) const { return this->drift ? (id / this->drift + id % this->hosts) & 0xFFFF : id % this->hosts; }
+
+    const nf_conntrack* make(size_t id, uint8_t tcp_state) { return this->make(id, this->getHost(id), tcp_state); }
+
+    const nf_conntrack* make(size_t id, size_t host, uint8_t tcp_state)
+    {
+        uint32_t local_ip = localAddress(id);
+        uint32_t remote_ip = htonl((192u << 24) + (168u << 16) + static_cast<uint32_t>(host));
+        uint16_t local_port = htons(static_cast<uint16_t>(id & 0xFFFF));
+        uint16_t remote_port = htons(443);
+
+        nfct_set_attr_u32(this->ct, ATTR_ORIG_IPV4_SRC, local_ip);
+        nfct_set_attr_u32(this->ct, ATTR_ORIG_IPV4_DST, remote_ip);
+        nfct_set_attr_u32(this->ct, ATTR_REPL_IPV4_SRC, remote_ip);
+        nfct_set_attr_u32(this->ct, ATTR_REPL_IPV4_DST, local_ip);
+        nfct_set_attr_u16(this->ct, ATTR_ORIG_PORT_SRC, local_port);
+        nfct_set_attr_u16(this->ct, ATTR_ORIG_PORT_DST, remote_port);
+        nfct_set_attr_u16(this->ct, ATTR_REPL_PORT_SRC, remote_port);
+        nfct_set_attr_u16(this->ct, ATTR_REPL_PORT_DST, local_port);
+        nfct_set_attr_u8(this->ct, ATTR_TCP_STATE, tcp_state);
+        return this->ct;
+    }
+
+    size_t hosts;
+    size_t drift = 0;
+    nf_conntrack* ct;
+};
+
+// The state a connection moves to on its next update:
+static uint8_t nextState(uint8_t state)
+{
+    switch (state)
+    {
+        case TCP_CONNTRACK_SYN_SENT: return TCP_CONNTRACK_ESTABLISHED;
+        case TCP_CONNTRACK_ESTABLISHED: return TCP_CONNTRACK_FIN_WAIT;
+        case TCP_CONNTRACK_FIN_WAIT: return TCP_CONNTRACK_TIME_WAIT;
+        case TCP_CONNTRACK_TIME_WAIT: return TCP_CONNTRACK_CLOSE;
+        default: return TCP_CONNTRACK_ESTABLISHED;
+    }
+}
+
+// The event log formatting as it was before the in-place formatters, kept so
+// the two can be compared on the same machine:
+namespace legacy {
+
+static string hostToString(uint32_t ip, uint16_t port)
+{
+    char output[INET_ADDRSTRLEN];
+    if (inet_ntop(AF_INET, (void*)&ip, output, INET_ADDRSTRLEN) == NULL)
+        return string("");
+
+    return string(output) + ":" + to_string(ntohs(port));
+}
+
+static string stateToString(const ConnectionState state)
+{
+    switch (state)
+    {
+        case ConnectionState::OPENING: return "Opening";
+        case ConnectionState::OPEN: return "Open";
+        case ConnectionState::CLOSING: return "Closing";
+        case ConnectionState::CLOSED: return "Closed";
+    }
+    return "";
+}
+
+static const char* eventTypeToString(nf_conntrack_msg_type event_type)
+{
+    return
+        (event_type == NFCT_T_NEW) ? "new" :
+        (event_type == NFCT_T_UPDATE) ? "update" :
+        (event_type == NFCT_T_DESTROY) ? "destroy" :
+        "";
+}
+
+static string toJSON(const Connection& connection, nf_conntrack_msg_type event_type)
+{
+    const ConnectionKey& key = connection.getKey();
+    const Endpoint& remote = connection.getRemoteEndpoint();
+    stringstream output;
+    output << "{";
+
+    if (event_type != NFCT_T_UNKNOWN)
+        output << "\"event_type\":\"" << eventTypeToString(event_type) << "\",";
+
+    output
+        << "\"original_source_host\":\"" << hostToString(key.original_source_ip, key.original_source_port) << "\","
+        << "\"original_destination_host\":\"" << hostToString(key.original_destination_ip, key.original_destination_port) << "\","
+        << "\"reply_source_host\":\"" << hostToString(key.reply_source_ip, key.reply_source_port) << "\","
+        << "\"reply_destination_host\":\"" << hostToString(key.reply_destination_ip, key.reply_destination_port) << "\","
+        << "\"remote_host\":\"" << hostToString(remote.ip, remote.port) << "\","
+        << "\"state\":\"" << (connection.hasState() ? stateToString(connection.getState()) : "None") << "\""
+        << "}";
+    return output.str();
+}
+
+static string toNetFilter(const nf_conntrack* ct, nf_conntrack_msg_type event_type)
+{
+    stringstream output;
+
+    if (event_type != NFCT_T_UNKNOWN)
+        output << "event=" << left << setw(10) << eventTypeToString(event_type) << " ";
+
+    char buffer[1024];
+    nfct_snprintf(buffer, sizeof(buffer), ct, NFCT_T_ALL, NFCT_O_DEFAULT, NFCT_OF_TIME | NFCT_OF_TIMESTAMP | NFCT_OF_SHOW_LAYER3);
+    output << buffer;
+
+    return output.str();
+}
+
+} // namespace legacy
+
+static double peakRSSMegabytes()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0; // ru_maxrss is in kilobytes on Linux
+}
+
+static double currentRSSMegabytes()
+{
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+
+    unsigned long size = 0, resident = 0;
+    if (fscanf(file, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(file);
+    return resident * sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+static void printLatencies(const string& name, vector<uint32_t>& latencies, double seconds)
+{
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) { return latencies[min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))]; };
+
+    cout << name << ": " << latencies.size() << " events in " << fixed << setprecision(3) << seconds << " s, "
+         << setprecision(0) << latencies.size() / seconds << " events/s" << endl
+         << "  latency ns: p50=" << percentile(0.5) << " p90=" << percentile(0.9) << " p99=" << percentile(0.99)
+         << " p99.9=" << percentile(0.999) << " max=" << latencies.back() << endl;
+}
+
+int main(int argc, char** argv)
+{
+    argagg::parser argument_parser {{
+        { "table_size", {"--table-size"}, "Connections in the table before the measured events (default: 100000)", 1 },
+        { "events", {"--events"}, "Measured events (default: 1000000)", 1 },
+        { "mix", {"--mix"}, "Percentages of NEW:UPDATE:DESTROY events (default: 20:60:20)", 1 },
+        { "hosts", {"--hosts"}, "Distinct remote hosts (default: 1000)", 1 },
+        { "scrapes", {"--scrapes"}, "Scrapes to time (default: 10)", 1 },
+        { "seed", {"--seed"}, "Random seed (default: 1)", 1 },
+        { "soak_rounds", {"--soak-rounds"}, "Rounds of sustained churn after the other measurements, each followed by a scrape, to watch memory and latency over time (default: 0)", 1 },
+        { "soak_events", {"--soak-events"}, "Events per soak round (default: 1000000)", 1 },
+        { "soak_drift", {"--soak-drift"}, "During the soak, move the range of remote hosts up by one every this many connections (default: 100)", 1 },
+        { "help", {"-h", "--help"}, "Print help and exit", 0 },
+    }};
+    argagg::parser_results args;
+    try
+    {
+        args = argument_parser.parse(argc, argv);
+    }
+    catch (const std::exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl << argument_parser << endl;
+        return EXIT_FAILURE;
+    }
+    if (args["help"])
+    {
+        cerr << "Usage: " << argv[0] << " [options]" << endl << argument_parser << endl;
+        return EXIT_SUCCESS;
+    }
+
+    const size_t table_size = args["table_size"].as<size_t>(100000);
+    const size_t event_count = args["events"].as<size_t>(1000000);
+    const size_t hosts = max<size_t>(1, args["hosts"].as<size_t>(1000));
+    const size_t scrapes = args["scrapes"].as<size_t>(10);
+    const size_t soak_rounds = args["soak_rounds"].as<size_t>(0);
+    const size_t soak_events = args["soak_events"].as<size_t>(1000000);
+    const size_t soak_drift = max<size_t>(1, args["soak_drift"].as<size_t>(100));
+    unsigned mix[3] = {20, 60, 20};
+    if (args["mix"] && sscanf(args["mix"].as<std::string>().c_str(), "%u:%u:%u", &mix[0], &mix[1], &mix[2]) != 3)
+    {
+        cerr << "ERROR: --mix must look like NEW:UPDATE:DESTROY" << endl;
+        return EXIT_FAILURE;
+    }
+    mt19937_64 random(args["seed"].as<unsigned int>(1));
+
+    ConnectionTable table;
+    for (size_t i = 0; i < 256; i++)
+        table.getLocalAddresses().add(SyntheticEvents::localAddress(i << 16));
+    SyntheticEvents events(hosts);
+
+    // Live connections, their remote hosts and their current TCP state,
+    // indexed alike:
+    vector<size_t> live_ids;
+    vector<size_t> live_hosts;
+    vector<uint8_t> live_states;
+    live_ids.reserve(table_size + event_count);
+    live_hosts.reserve(table_size + event_count);
+    live_states.reserve(table_size + event_count);
+    size_t next_id = 0;
+
+    vector<uint32_t> latencies;
+    latencies.reserve(max(table_size, event_count));
+
+    // Fill the table:
+    auto fill_start = Clock::now();
+    for (; next_id < table_size; next_id++)
+    {
+        auto ct = events.make(next_id, TCP_CONNTRACK_ESTABLISHED);
+        auto start = Clock::now();
+        table.processEvent(NFCT_T_NEW, ct);
+        latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+        live_ids.push_back(next_id);
+        live_hosts.push_back(events.getHost(next_id));
+        live_states.push_back(TCP_CONNTRACK_ESTABLISHED);
+    }
+    if (!latencies.empty())
+        printLatencies("fill", latencies, chrono::duration<double>(Clock::now() - fill_start).count());
+
+    // A random event from the mix, timed:
+    unsigned mix_total = max(1u, mix[0] + mix[1] + mix[2]);
+    auto processRandomEvent = [&]()
+    {
+        unsigned roll = random() % mix_total;
+        enum nf_conntrack_msg_type type;
+        const nf_conntrack* ct;
+
+        if (roll < mix[0] || live_ids.empty())
+        {
+            type = NFCT_T_NEW;
+            size_t id = next_id++ & 0xFFFFFF;
+            ct = events.make(id, TCP_CONNTRACK_SYN_SENT);
+            live_ids.push_back(id);
+            live_hosts.push_back(events.getHost(id));
+            live_states.push_back(TCP_CONNTRACK_SYN_SENT);
+        }
+        else
+        {
+            size_t index = random() % live_ids.size();
+            if (roll < mix[0] + mix[1])
+            {
+                type = NFCT_T_UPDATE;
+                live_states[index] = nextState(live_states[index]);
+                ct = events.make(live_ids[index], live_hosts[index], live_states[index]);
+            }
+            else
+            {
+                type = NFCT_T_DESTROY;
+                ct = events.make(live_ids[index], live_hosts[index], live_states[index]);
+                live_ids[index] = live_ids.back();
+                live_ids.pop_back();
+                live_hosts[index] = live_hosts.back();
+                live_hosts.pop_back();
+                live_states[index] = live_states.back();
+                live_states.pop_back();
+            }
+        }
+
+        auto start = Clock::now();
+        table.processEvent(type, ct);
+        latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count());
+    };
+
+    // Mixed events against the filled table:
+    latencies.clear();
+    auto mixed_start = Clock::now();
+    for (size_t i = 0; i < event_count; i++)
+        processRandomEvent();
+    if (!latencies.empty())
+        printLatencies("mixed", latencies, chrono::duration<double>(Clock::now() - mixed_start).count());
+    cout << "table: " << table.getConnections().size() << " connections, "
+         << table.getHostCount() << " hosts" << endl;
+
+    // Scrapes: publish a snapshot, build the families and serialize them.
+    // Every scrape sees a changed table, so none is served from a cache:
+    ConnectionMetrics metrics(table);
+    prometheus::TextSerializer serializer;
+    double publish_total = 0, collect_total = 0, serialize_total = 0;
+    size_t page_size = 0;
+    for (size_t i = 0; i < scrapes; i++)
+    {
+        table.processEvent(NFCT_T_NEW, events.make(next_id++ & 0xFFFFFF, TCP_CONNTRACK_SYN_SENT));
+
+        auto start = Clock::now();
+        table.publishSnapshot();
+        metrics.getGeneration();
+        auto published = Clock::now();
+        auto families = metrics.Collect();
+        auto collected = Clock::now();
+        page_size = serializer.Serialize(families).size();
+        auto serialized = Clock::now();
+
+        publish_total += chrono::duration<double, milli>(published - start).count();
+        collect_total += chrono::duration<double, milli>(collected - published).count();
+        serialize_total += chrono::duration<double, milli>(serialized - collected).count();
+    }
+    if (scrapes)
+    {
+        cout << "scrape ms: snapshot=" << setprecision(3) << publish_total / scrapes
+             << " collect=" << collect_total / scrapes
+             << " serialize=" << serialize_total / scrapes
+             << " (" << page_size << " bytes)" << endl;
+    }
+
+    // Event log line formatting, in place and through the old stringstream
+    // path. Both must produce the same lines:
+    char line[512];
+    size_t formatted = 0;
+    const size_t format_count = 100000;
+    Connection connection(events.make(0, TCP_CONNTRACK_ESTABLISHED), table.getLocalAddresses());
+    connection.setEventType(NFCT_T_UPDATE);
+    if (string(line, connection.formatJSON(line, sizeof(line))) != legacy::toJSON(connection, NFCT_T_UPDATE) ||
+        string(line, Connection::formatNetFilter(line, sizeof(line), events.ct, NFCT_T_UPDATE)) != legacy::toNetFilter(events.ct, NFCT_T_UPDATE))
+    {
+        cerr << "ERROR: the formatters disagree with the stringstream path" << endl;
+        return EXIT_FAILURE;
+    }
+
+    auto formatTime = [&](const function<size_t()>& format)
+    {
+        auto start = Clock::now();
+        for (size_t i = 0; i < format_count; i++)
+            formatted += format();
+        return chrono::duration<double, nano>(Clock::now() - start).count() / format_count;
+    };
+    double json = formatTime([&]() { return connection.formatJSON(line, sizeof(line)); });
+    double legacy_json = formatTime([&]() { return legacy::toJSON(connection, NFCT_T_UPDATE).size(); });
+    double netfilter = formatTime([&]() { return Connection::formatNetFilter(line, sizeof(line), events.ct, NFCT_T_UPDATE); });
+    double legacy_netfilter = formatTime([&]() { return legacy::toNetFilter(events.ct, NFCT_T_UPDATE).size(); });
+    cout << "format ns/event: json=" << fixed << setprecision(0) << json
+         << " (stringstream " << legacy_json << ")"
+         << " netfilter=" << netfilter
+         << " (stringstream " << legacy_netfilter << ")"
+         << " (" << formatted << " bytes)" << endl;
+
+    // Soak: sustained churn through hosts that come and go, with a scrape
+    // after every round. Each round stands for one expiry interval of the
+    // host totals. Resident memory, scrape time, series count and latency
+    // should all level off rather than keep growing:
+    events.drift = soak_drift;
+    for (size_t round = 1; round <= soak_rounds; round++)
+    {
+        latencies.clear();
+        auto round_start = Clock::now();
+        for (size_t i = 0; i < soak_events; i++)
+            processRandomEvent();
+        double round_seconds = chrono::duration<double>(Clock::now() - round_start).count();
+        table.expireHostTotals();
+
+        auto scrape_start = Clock::now();
+        table.publishSnapshot();
+        metrics.getGeneration();
+        auto families = metrics.Collect();
+        size_t page = serializer.Serialize(families).size();
+        double scrape_ms = chrono::duration<double, milli>(Clock::now() - scrape_start).count();
+
+        size_t series = 0;
+        for (auto& family : families)
+            series += family.metric.size();
+
+        sort(latencies.begin(), latencies.end());
+        auto percentile = [&](double p) { return latencies.empty() ? 0 : latencies[min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))]; };
+        cout << "soak " << round << "/" << soak_rounds << ": " << fixed << setprecision(1) << currentRSSMegabytes() << " MB RSS, "
+             << table.getConnections().size() << " connections, " << table.getHostCount() << " hosts, "
+             << series << " series (" << page << " bytes), scrape " << setprecision(3) << scrape_ms << " ms, "
+             << setprecision(0) << soak_events / round_seconds << " events/s, p99 " << percentile(0.99) << " ns" << endl;
+    }
+
+    cout << "peak RSS: " << setprecision(1) << peakRSSMegabytes() << " MB" << endl;
+    return EXIT_SUCCESS;
+}
@@ -1,68 +1,111 @@
 #include "connection.h"
 
 #include <cassert>
-#include <sys/types.h>
-#include <ifaddrs.h>
 #include <algorithm>
 #include <iostream>
-#include <iomanip>
 
 
 namespace conntrackex {
 
 using namespace std;
 
-list<string> Connection::local_ip_addresses;
-
-Connection::Connection(nf_conntrack* ct)
+string Endpoint::toString() const
 {
-    this->conntrack = nfct_clone(ct);
+    char output[MAX_ENDPOINT_LENGTH];
+    return string(output, this->format(output));
 }
 
-Connection::Connection(const Connection &other)
+Connection::Connection(const nf_conntrack* ct, const LocalAddressSet& local_addresses)
 {
-    this->conntrack = nfct_clone(other.conntrack);
+    // Addresses and ports are kept in network byte order, as netfilter hands them to us:
+    this->key.original_source_ip = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC);
+    this->key.original_destination_ip = nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_DST);
+    this->key.reply_source_ip = nfct_get_attr_u32(ct, ATTR_REPL_IPV4_SRC);
+    this->key.reply_destination_ip = nfct_get_attr_u32(ct, ATTR_REPL_IPV4_DST);
+    this->key.original_source_port = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC);
+    this->key.original_destination_port = nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST);
+    this->key.reply_source_port = nfct_get_attr_u16(ct, ATTR_REPL_PORT_SRC);
+    this->key.reply_destination_port = nfct_get_attr_u16(ct, ATTR_REPL_PORT_DST);
+
+    if (nfct_attr_is_set(ct, ATTR_TCP_STATE) > 0)
+        this->tcp_state = nfct_get_attr_u8(ct, ATTR_TCP_STATE);
+
+    if (nfct_attr_is_set(ct, ATTR_TIMESTAMP_START) > 0)
+    {
+        this->timestamp_start = nfct_get_attr_u64(ct, ATTR_TIMESTAMP_START);
+        if (nfct_attr_is_set(ct, ATTR_TIMESTAMP_STOP) > 0)
+            this->timestamp_stop = nfct_get_attr_u64(ct, ATTR_TIMESTAMP_STOP);
+        this->flags |= HAS_TIMESTAMPS;
+    }
+
+    if (nfct_attr_is_set(ct, ATTR_ORIG_COUNTER_BYTES) > 0)
+    {
+        this->original_bytes = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES);
+        this->original_packets = nfct_get_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS);
+        this->reply_bytes = nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_BYTES);
+        this->reply_packets = nfct_get_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS);
+        this->flags |= HAS_COUNTERS;
+    }
+
+    this->resolveRemoteEndpoint(local_addresses);
 }
 
-Connection::~Connection()
+void Connection::inheritCounters(const Connection& previous)
 {
-    nfct_destroy(this->conntrack);
-    this->conntrack = NULL;
-}
+    if (this->hasCounters() || !previous.hasCounters())
+        return;
 
-// Source and destination that initiated the connection:
-string Connection::getOriginalSourceIP() const          { return ip32ToString(nfct_get_attr_u32(this->conntrack, ATTR_ORIG_IPV4_SRC    )); }
-uint16_t Connection::getOriginalSourcePort() const      { return ntohs(nfct_get_attr_u16(       this->conntrack, ATTR_ORIG_PORT_SRC    )); }
-string Connection::getOriginalDestinationIP() const     { return ip32ToString(nfct_get_attr_u32(this->conntrack, ATTR_ORIG_IPV4_DST    )); }
-uint16_t Connection::getOriginalDestinationPort() const { return ntohs(nfct_get_attr_u16(       this->conntrack, ATTR_ORIG_PORT_DST    )); }
+    this->original_bytes = previous.original_bytes;
+    this->original_packets = previous.original_packets;
+    this->reply_bytes = previous.reply_bytes;
+    this->reply_packets = previous.reply_packets;
+    this->flags |= HAS_COUNTERS;
+}
 
-// Source and destination of the expected (in case of [UNREPLIED]) or actual (in case of [ASSURED]) response:
-string Connection::getReplySourceIP() const             { return ip32ToString(nfct_get_attr_u32(this->conntrack, ATTR_REPL_IPV4_SRC    )); }
-uint16_t Connection::getReplySourcePort() const         { return ntohs(nfct_get_attr_u16(       this->conntrack, ATTR_REPL_PORT_SRC    )); }
-string Connection::getReplyDestinationIP() const        { return ip32ToString(nfct_get_attr_u32(this->conntrack, ATTR_REPL_IPV4_DST    )); }
-uint16_t Connection::getReplyDestinationPort() const    { return ntohs(nfct_get_attr_u16(       this->conntrack, ATTR_REPL_PORT_DST    )); }
+bool Connection::isTrackable(const nf_conntrack* ct)
+{
+    return nfct_get_attr_u8(ct, ATTR_L3PROTO) == AF_INET;
+}
 
-string Connection::getRemoteHost() const
+void Connection::resolveRemoteEndpoint(const LocalAddressSet& local_addresses)
 {
-    if (isLocalIPAddress(this->getOriginalSourceIP()))
-        return this->getOriginalDestinationHost();
-    else if (isLocalIPAddress(this->getOriginalDestinationIP()))
-        return this->getOriginalSourceHost();
-    else if (isLocalIPAddress(this->getReplySourceIP()))
-        return this->getReplyDestinationHost();
+    this->flags &= ~(IS_INBOUND | IS_TRANSLATED);
+
+    if (local_addresses.contains(this->key.original_source_ip))
+    {
+        this->remote.ip = this->key.original_destination_ip;
+        this->remote.port = this->key.original_destination_port;
+    }
+    else if (local_addresses.contains(this->key.original_destination_ip))
+    {
+        this->remote.ip = this->key.original_source_ip;
+        this->remote.port = this->key.original_source_port;
+        this->flags |= IS_INBOUND;
+    }
+    else if (local_addresses.contains(this->key.reply_source_ip))
+    {
+        // Inbound to a NATed address that was rewritten to one of ours:
+        this->remote.ip = this->key.reply_destination_ip;
+        this->remote.port = this->key.reply_destination_port;
+        this->flags |= IS_INBOUND | IS_TRANSLATED;
+    }
     else
     {
-        // if (!isLocalIPAddress(this->getReplyDestinationIP()))
+        // if (!local_addresses.contains(this->key.reply_destination_ip))
         //     cerr << "[WARNING] Couldn't identify a local IP address in a connection." << endl;
 
-        return this->getReplySourceHost();
+        this->remote.ip = this->key.reply_source_ip;
+        this->remote.port = this->key.reply_source_port;
+        this->flags |= IS_TRANSLATED;
     }
 }
 
-bool Connection::hasState() const
+bool Connection::involvesAddress(uint32_t ip) const
 {
-    return (nfct_attr_is_set(this->conntrack, ATTR_TCP_STATE) != -1 &&
-            nfct_get_attr_u8(this->conntrack, ATTR_TCP_STATE) != TCP_CONNTRACK_NONE);
+    return (this->key.original_source_ip == ip ||
+            this->key.original_destination_ip == ip ||
+            this->key.reply_source_ip == ip ||
+            this->key.reply_destination_ip == ip);
 }
 
 ConnectionState Connection::getState() const
@@ -71,7 +114,7 @@ ConnectionState Connection::getState() const
     if (!this->hasState())
         throw logic_error("Connection state not available.");
 
-    auto tcp_state = nfct_get_attr_u8(this->conntrack, ATTR_TCP_STATE);
+    auto tcp_state = this->tcp_state;
 
     // We don't expect to see MAX or IGNORE.
     assert(tcp_state != TCP_CONNTRACK_MAX);
@@ -100,52 +143,143 @@ ConnectionState Connection::getState() const
 
 string Connection::toString() const
 {
-    stringstream output;
-    output << "{";
+    char buffer[MAX_JSON_LENGTH];
+    return string(buffer, this->formatJSON(buffer, sizeof(buffer)));
+}
+
+size_t Connection::formatJSON(char* buffer, size_t size) const
+{
+    if (size == 0)
+        return 0;
 
+    // Format in place when the buffer is known to be big enough, or on the
+    // stack and then truncate:
+    char scratch[MAX_JSON_LENGTH];
+    char* start = (size >= MAX_JSON_LENGTH) ? buffer : scratch;
+    char* output = start;
+
+    output = formatLiteral(output, "{");
     if (this->hasEventType())
-        output << "\"event_type\":\"" << this->getEventTypeString() << "\",";
+    {
+        output = formatLiteral(output, "\"event_type\":\"");
+        const char* event_type = getEventTypeString(this->event_type);
+        output = formatString(output, event_type, strlen(event_type));
+        output = formatLiteral(output, "\",");
+    }
 
-    output
-        << "\"original_source_host\":\"" << this->getOriginalSourceHost() << "\","
-        << "\"original_destination_host\":\"" << this->getOriginalDestinationHost() << "\","
-        << "\"reply_source_host\":\"" << this->getReplySourceHost() << "\","
-        << "\"reply_destination_host\":\"" << this->getReplyDestinationHost() << "\","
-        << "\"remote_host\":\"" << this->getRemoteHost() << "\","
-        << "\"state\":\"" << (this->hasState() ? this->getStateString() : "None") << "\""
-        << "}";
-    return output.str();
+    output = formatLiteral(output, "\"original_source_host\":\"");
+    output = formatEndpoint(output, this->key.original_source_ip, this->key.original_source_port);
+    output = formatLiteral(output, "\",\"original_destination_host\":\"");
+    output = formatEndpoint(output, this->key.original_destination_ip, this->key.original_destination_port);
+    output = formatLiteral(output, "\",\"reply_source_host\":\"");
+    output = formatEndpoint(output, this->key.reply_source_ip, this->key.reply_source_port);
+    output = formatLiteral(output, "\",\"reply_destination_host\":\"");
+    output = formatEndpoint(output, this->key.reply_destination_ip, this->key.reply_destination_port);
+    output = formatLiteral(output, "\",\"remote_host\":\"");
+    output = this->remote.format(output);
+    output = formatLiteral(output, "\",\"state\":\"");
+    const char* state = this->hasState() ? stateToString(this->getState()) : "None";
+    output = formatString(output, state, strlen(state));
+    output = formatLiteral(output, "\"}");
+
+    size_t length = output - start;
+    if (start == scratch)
+    {
+        length = min(length, size - 1);
+        memcpy(buffer, scratch, length);
+    }
+    buffer[length] = '\0';
+    return length;
 }
 
 string Connection::toNetFilterString() const
 {
-    stringstream output;
+    auto ct = this->toConntrack();
+    auto output = toNetFilterString(ct, this->event_type);
+    nfct_destroy(ct);
 
-    if (this->hasEventType())
-        output << "event=" << left << std::setw(10) << this->getEventTypeString() << " ";
+    return output;
+}
 
+string Connection::toNetFilterString(const nf_conntrack* ct, nf_conntrack_msg_type event_type)
+{
     char buffer[1024];
-    nfct_snprintf(buffer, sizeof(buffer), this->conntrack, NFCT_T_ALL, NFCT_O_DEFAULT, NFCT_OF_TIME | NFCT_OF_TIMESTAMP | NFCT_OF_SHOW_LAYER3);
-    output << buffer;
+    return string(buffer, formatNetFilter(buffer, sizeof(buffer), ct, event_type));
+}
 
-    return output.str();
+size_t Connection::formatNetFilter(char* buffer, size_t size, const nf_conntrack* ct, nf_conntrack_msg_type event_type)
+{
+    // Matches the "event=%-10s " prefix of the conntrack tools:
+    const size_t EVENT_PREFIX_LENGTH = 17;
+    if (size <= EVENT_PREFIX_LENGTH)
+    {
+        if (size)
+            buffer[0] = '\0';
+        return 0;
+    }
+
+    size_t length = 0;
+    if (event_type != NFCT_T_UNKNOWN)
+    {
+        char* output = formatLiteral(buffer, "event=");
+        const char* name = getEventTypeString(event_type);
+        output = formatString(output, name, strlen(name));
+        memset(output, ' ', buffer + EVENT_PREFIX_LENGTH - output);
+        length = EVENT_PREFIX_LENGTH;
+    }
+
+    int written = nfct_snprintf(buffer + length, size - length, ct, NFCT_T_ALL, NFCT_O_DEFAULT, NFCT_OF_TIME | NFCT_OF_TIMESTAMP | NFCT_OF_SHOW_LAYER3);
+    if (written > 0)
+        length += min(static_cast<size_t>(written), size - length - 1);
+    buffer[length] = '\0';
+    return length;
 }
 
-bool Connection::operator==(const Connection& other) const
+nf_conntrack* Connection::toConntrack() const
 {
-    return (nfct_cmp(this->conntrack, other.conntrack, NFCT_CMP_ORIG | NFCT_CMP_REPL) == 1);
+    auto ct = nfct_new();
+    if (!ct)
+        throw runtime_error("Unable to allocate a conntrack object.");
+
+    nfct_set_attr_u8(ct, ATTR_L3PROTO, AF_INET);
+    nfct_set_attr_u8(ct, ATTR_L4PROTO, IPPROTO_TCP);
+    nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_SRC, this->key.original_source_ip);
+    nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_DST, this->key.original_destination_ip);
+    nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC, this->key.reply_source_ip);
+    nfct_set_attr_u32(ct, ATTR_REPL_IPV4_DST, this->key.reply_destination_ip);
+    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, this->key.original_source_port);
+    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, this->key.original_destination_port);
+    nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC, this->key.reply_source_port);
+    nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST, this->key.reply_destination_port);
+
+    if (this->hasState())
+        nfct_set_attr_u8(ct, ATTR_TCP_STATE, this->tcp_state);
+
+    if (this->hasTimestamps())
+    {
+        nfct_set_attr_u64(ct, ATTR_TIMESTAMP_START, this->timestamp_start);
+        if (this->timestamp_stop != 0)
+            nfct_set_attr_u64(ct, ATTR_TIMESTAMP_STOP, this->timestamp_stop);
+    }
+
+    if (this->hasCounters())
+    {
+        nfct_set_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES, this->original_bytes);
+        nfct_set_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS, this->original_packets);
+        nfct_set_attr_u64(ct, ATTR_REPL_COUNTER_BYTES, this->reply_bytes);
+        nfct_set_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS, this->reply_packets);
+    }
+
+    return ct;
 }
 
 string Connection::ip32ToString(uint32_t ip32)
 {
-    char output[INET_ADDRSTRLEN];
-
-    return (inet_ntop(AF_INET, (void*)&ip32, output, INET_ADDRSTRLEN) != NULL) ?
-        string((char*)&output) :
-        string("");
+    char output[MAX_IPV4_LENGTH];
+    return string(output, formatIPv4(output, ip32));
 }
 
-string Connection::stateToString(const ConnectionState state)
+const char* Connection::stateToString(const ConnectionState state)
 {
     switch (state)
     {
@@ -158,60 +292,13 @@ string Connection::stateToString(const ConnectionState state)
     return "";
 }
 
-inline const string Connection::getEventTypeString() const
+const char* Connection::getEventTypeString(nf_conntrack_msg_type event_type)
 {
     return
-        (this->event_type == NFCT_T_NEW) ? "new" :
-        (this->event_type == NFCT_T_UPDATE) ? "update" :
-        (this->event_type == NFCT_T_DESTROY) ? "destroy" :
+        (event_type == NFCT_T_NEW) ? "new" :
+        (event_type == NFCT_T_UPDATE) ? "update" :
+        (event_type == NFCT_T_DESTROY) ? "destroy" :
         "";
 }
 
-void Connection::loadLocalIPAddresses(bool log_debug_messages)
-{
-    // This method inspired by GetNetworkInterfaceInfos() in
-    // https://public.msli.com/lcs/muscle/muscle/util/NetworkUtilityFunctions.cpp
-
-    // Singleton gatekeeper:
-    static bool initalized = false;
-    if (initalized)
-        return;
-    initalized = true;
-
-    struct ifaddrs* ifap;
-    if (getifaddrs(&ifap) != 0)
-    {
-        cerr << "[WARNING] Can't get local network interface addresses." << endl;
-        return;
-    }
-
-    auto current_ifap = ifap;
-    while(current_ifap)
-    {
-        //const string interface_name = current_ifap->ifa_name;
-        if (current_ifap->ifa_addr &&
-            current_ifap->ifa_addr->sa_family == AF_INET)
-        {
-            auto ip_address = ((struct sockaddr_in*)current_ifap->ifa_addr)->sin_addr.s_addr;
-            auto ip_address_str = ip32ToString(ip_address);
-            Connection::local_ip_addresses.push_back(ip_address_str);
-
-            if (log_debug_messages)
-                cout << "[DEBUG] Found local IP: '" << ip_address_str << "'" << endl;
-        }
-
-        current_ifap = current_ifap->ifa_next;
-    }
-
-    freeifaddrs(ifap);
-}
-
-bool Connection::isLocalIPAddress(const string& ip_address)
-{
-    loadLocalIPAddresses();
-    return (find(Connection::local_ip_addresses.begin(),
-                 Connection::local_ip_addresses.end(),
-                 ip_address) != Connection::local_ip_addresses.end());
-}
-
 } // namespace conntrackex
@@ -1,12 +1,16 @@
 #pragma once
 
 #include <string>
-#include <list>
 #include <sstream>
+#include <cstring>
+#include <type_traits>
 #include <arpa/inet.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack_tcp.h>
 
+#include "local_addresses.h"
+#include "text_format.h"
+
 
 namespace conntrackex {
 
@@ -20,53 +24,174 @@ enum class ConnectionState : unsigned char
     CLOSED
 };
 
+// The original and reply tuples of a connection, packed into a fixed-size
+// binary key. Two conntrack entries are the same connection exactly when
+// their keys are equal.
+struct ConnectionKey
+{
+    uint32_t original_source_ip;
+    uint32_t original_destination_ip;
+    uint32_t reply_source_ip;
+    uint32_t reply_destination_ip;
+    uint16_t original_source_port;
+    uint16_t original_destination_port;
+    uint16_t reply_source_port;
+    uint16_t reply_destination_port;
+
+    bool operator==(const ConnectionKey& other) const { return memcmp(this, &other, sizeof(ConnectionKey)) == 0; }
+};
+
+struct ConnectionKeyHash
+{
+    size_t operator()(const ConnectionKey& key) const
+    {
+        uint64_t words[3];
+        static_assert(sizeof(words) == sizeof(ConnectionKey), "ConnectionKey must pack into three 64-bit words");
+        memcpy(words, &key, sizeof(words));
+
+        uint64_t hash = words[0] ^ (words[1] * 0x9E3779B97F4A7C15ULL) ^ (words[2] * 0xC2B2AE3D27D4EB4FULL);
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        return static_cast<size_t>(hash);
+    }
+};
+
+// An IPv4 address and port, both in network byte order.
+struct Endpoint
+{
+    uint32_t ip = 0;
+    uint16_t port = 0;
+
+    bool operator==(const Endpoint& other) const { return this->ip == other.ip && this->port == other.port; }
+    bool operator!=(const Endpoint& other) const { return !(*this == other); }
+    string toString() const;
+    char* format(char* output) const { return formatEndpoint(output, this->ip, this->port); }
+};
+
+struct EndpointHash
+{
+    size_t operator()(const Endpoint& endpoint) const
+    {
+        uint64_t hash = (static_cast<uint64_t>(endpoint.ip) << 16) | endpoint.port;
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        return static_cast<size_t>(hash);
+    }
+};
+
+// A compact, fixed-size record of the conntrack attributes the exporter
+// uses, decoded once when an event arrives. Records are plain data so the
+// connection table can store them inline without per-entry allocations; a
+// full nf_conntrack object is only rebuilt when netfilter-format output
+// needs one.
 class Connection
 {
 public:
 
-    Connection(nf_conntrack* ct);
-    Connection(const Connection &other);
-    ~Connection();
+    Connection() {}
+    Connection(const nf_conntrack* ct, const LocalAddressSet& local_addresses);
+
+    // Whether the exporter can track this conntrack entry (IPv4 only):
+    static bool isTrackable(const nf_conntrack* ct);
 
-    static void loadLocalIPAddresses(bool log_debug_messages = false);
+    const ConnectionKey& getKey() const { return this->key; }
 
-    string getOriginalSourceIP() const;
-    uint16_t getOriginalSourcePort() const;
+    string getOriginalSourceIP() const { return ip32ToString(this->key.original_source_ip); }
+    uint16_t getOriginalSourcePort() const { return ntohs(this->key.original_source_port); }
     string getOriginalSourceHost() const { return this->getOriginalSourceIP() + ":" + to_string(this->getOriginalSourcePort()); }
-    string getOriginalDestinationIP() const;
-    uint16_t getOriginalDestinationPort() const;
+    string getOriginalDestinationIP() const { return ip32ToString(this->key.original_destination_ip); }
+    uint16_t getOriginalDestinationPort() const { return ntohs(this->key.original_destination_port); }
     string getOriginalDestinationHost() const { return this->getOriginalDestinationIP() + ":" + to_string(this->getOriginalDestinationPort()); }
-    string getReplySourceIP() const;
-    uint16_t getReplySourcePort() const;
+    string getReplySourceIP() const { return ip32ToString(this->key.reply_source_ip); }
+    uint16_t getReplySourcePort() const { return ntohs(this->key.reply_source_port); }
     string getReplySourceHost() const { return this->getReplySourceIP() + ":" + to_string(this->getReplySourcePort()); }
-    string getReplyDestinationIP() const;
-    uint16_t getReplyDestinationPort() const;
+    string getReplyDestinationIP() const { return ip32ToString(this->key.reply_destination_ip); }
+    uint16_t getReplyDestinationPort() const { return ntohs(this->key.reply_destination_port); }
     string getReplyDestinationHost() const { return this->getReplyDestinationIP() + ":" + to_string(this->getReplyDestinationPort()); }
 
-    string getRemoteHost() const;
+    // The endpoint on the far side of the connection, resolved at ingest and
+    // again whenever the set of local addresses changes:
+    const Endpoint& getRemoteEndpoint() const { return this->remote; }
+    void resolveRemoteEndpoint(const LocalAddressSet& local_addresses);
+    bool involvesAddress(uint32_t ip) const;
+
+    // Whether the remote endpoint opened the connection, i.e. its port is
+    // most likely ephemeral:
+    bool isInbound() const { return this->flags & IS_INBOUND; }
+
+    // Whether the original tuple named no local address, so the remote
+    // endpoint was taken from the reply tuple (NAT, or traffic forwarded
+    // through this host):
+    bool isTranslated() const { return this->flags & IS_TRANSLATED; }
+    string getRemoteHost() const { return this->remote.toString(); }
 
-    bool hasState() const;
+    bool hasState() const { return this->tcp_state != TCP_CONNTRACK_NONE; }
     ConnectionState getState() const;
     string getStateString() const { return stateToString(this->getState()); }
 
+    // Start/stop times in nanoseconds since the epoch (needs nf_conntrack_timestamp):
+    bool hasTimestamps() const { return this->flags & HAS_TIMESTAMPS; }
+    uint64_t getStartTimestamp() const { return this->timestamp_start; }
+    uint64_t getStopTimestamp() const { return this->timestamp_stop; }
+
+    // Byte and packet counters per direction (needs nf_conntrack_acct):
+    bool hasCounters() const { return this->flags & HAS_COUNTERS; }
+    uint64_t getOriginalBytes() const { return this->original_bytes; }
+    uint64_t getOriginalPackets() const { return this->original_packets; }
+    uint64_t getReplyBytes() const { return this->reply_bytes; }
+    uint64_t getReplyPackets() const { return this->reply_packets; }
+
+    // The kernel only attaches counters to dumps and DESTROY events, so a
+    // record decoded from any other event takes them from the previous one:
+    void inheritCounters(const Connection& previous);
+
     void setEventType(nf_conntrack_msg_type type) { this->event_type = type; }
     string toString() const;
     string toNetFilterString() const;
+    static string toNetFilterString(const nf_conntrack* ct, nf_conntrack_msg_type event_type);
 
-    bool operator==(const Connection& other) const;
+    // Write the same text as toString() and toNetFilterString() into the
+    // given buffer without allocating, truncating it to fit. Both return
+    // the length written, not counting the terminating null:
+    static const size_t MAX_JSON_LENGTH = 320;
+    size_t formatJSON(char* buffer, size_t size) const;
+    static size_t formatNetFilter(char* buffer, size_t size, const nf_conntrack* ct, nf_conntrack_msg_type event_type);
+
+    // Rebuilds a conntrack object from this record; the caller must nfct_destroy() it:
+    nf_conntrack* toConntrack() const;
+
+    bool operator==(const Connection& other) const { return this->key == other.key; }
 
 private:
 
+    enum : uint8_t
+    {
+        HAS_TIMESTAMPS = 1 << 0,
+        HAS_COUNTERS = 1 << 1,
+        IS_INBOUND = 1 << 2,
+        IS_TRANSLATED = 1 << 3
+    };
+
     static string ip32ToString(uint32_t ip32);
-    static string stateToString(const ConnectionState state);
+    static const char* stateToString(const ConnectionState state);
     bool hasEventType() const { return this->event_type != NFCT_T_UNKNOWN; }
-    const string getEventTypeString() const;
-
-    static bool isLocalIPAddress(const string& ip_address);
-    static list<string> local_ip_addresses;
-
-    nf_conntrack* conntrack;
+    static const char* getEventTypeString(nf_conntrack_msg_type event_type);
+
+    ConnectionKey key = {};
+    Endpoint remote;
+    uint64_t timestamp_start = 0;
+    uint64_t timestamp_stop = 0;
+    uint64_t original_bytes = 0;
+    uint64_t original_packets = 0;
+    uint64_t reply_bytes = 0;
+    uint64_t reply_packets = 0;
     nf_conntrack_msg_type event_type = NFCT_T_UNKNOWN;
+    uint8_t tcp_state = TCP_CONNTRACK_NONE;
+    uint8_t flags = 0;
 };
 
+static_assert(is_trivially_copyable<Connection>::value, "Connection records must stay plain data");
+
 } // namespace conntrackex
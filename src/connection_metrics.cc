@@ -0,0 +1,357 @@
+#include "connection_metrics.h"
+
+#include <limits>
+
+
+namespace conntrackex {
+
+using namespace std;
+using namespace prometheus;
+
+namespace {
+
+// How long a scrape waits for the ingestion thread to build a snapshot as of
+// the scrape before settling for the latest one:
+const chrono::milliseconds SNAPSHOT_TIMEOUT{1000};
+
+MetricFamily makeFamily(const string& name, const string& help, MetricType type)
+{
+    MetricFamily family;
+    family.name = name;
+    family.help = help;
+    family.type = type;
+    return family;
+}
+
+// Families in the order they're exported:
+enum Family
+{
+    OPENING_CONNECTIONS,
+    OPEN_CONNECTIONS,
+    CLOSING_CONNECTIONS,
+    CLOSED_CONNECTIONS,
+    CONNECTION_DURATION,
+    CONNECTION_OPENING,
+    SENT_BYTES,
+    SENT_PACKETS,
+    RECEIVED_BYTES,
+    RECEIVED_PACKETS,
+    NETLINK_OVERFLOWS,
+    RESYNCS,
+    LOG_EVENTS_DROPPED,
+    LOG_EVENTS_TRUNCATED,
+    EVENTS,
+    IGNORED_EVENTS,
+    NETLINK_READ_ERRORS,
+    EVENT_PROCESSING,
+    CONNECTIONS,
+    REMOTE_HOSTS,
+    REBUILD_DURATION,
+    REBUILD_CONNECTIONS,
+    SNAPSHOT_BUILD,
+    CONNECTION_MEMORY,
+    SHED_CONNECTIONS,
+    FAMILY_COUNT
+};
+
+vector<MetricFamily> makeFamilies()
+{
+    vector<MetricFamily> families;
+    families.reserve(FAMILY_COUNT);
+    families.push_back(makeFamily(
+        "conntrack_opening_connections",
+        "How many connections to the remote host are currently opening?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_open_connections",
+        "How many open connections are there to the remote host?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_closing_connections",
+        "How many connections to the remote host are currently closing?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_closed_connections",
+        "How many connections to the remote host have recently closed?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_connection_duration_seconds",
+        "How long did connections to the remote host last?",
+        MetricType::Histogram));
+    families.push_back(makeFamily(
+        "conntrack_connection_opening_seconds",
+        "How long did connections to the remote host take to open?",
+        MetricType::Histogram));
+    families.push_back(makeFamily(
+        "conntrack_sent_bytes_total",
+        "How many bytes were sent to the remote host?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_sent_packets_total",
+        "How many packets were sent to the remote host?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_received_bytes_total",
+        "How many bytes were received from the remote host?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_received_packets_total",
+        "How many packets were received from the remote host?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_exporter_netlink_overflows_total",
+        "How many times did the kernel drop conntrack events because the exporter's socket buffer was full?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_exporter_resyncs_total",
+        "How many times was the connection table reconciled against a fresh conntrack dump?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_exporter_log_events_dropped_total",
+        "How many connection events were left out of the event log because its writer fell behind?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_exporter_log_events_truncated_total",
+        "How many event log lines were cut short because they didn't fit the writer's line buffer?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_exporter_events_total",
+        "How many conntrack events of each type has the exporter received?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_exporter_ignored_events_total",
+        "How many conntrack events were skipped because their remote host is ignored?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_exporter_netlink_read_errors_total",
+        "How many times did reading from a conntrack socket fail?",
+        MetricType::Counter));
+    families.push_back(makeFamily(
+        "conntrack_exporter_event_processing_seconds",
+        "How long did the exporter take to apply a conntrack event to its table? (sampled: one in " +
+            to_string(TableStats::LATENCY_SAMPLE_INTERVAL) + " events)",
+        MetricType::Histogram));
+    families.push_back(makeFamily(
+        "conntrack_exporter_connections",
+        "How many connections is the exporter tracking?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_exporter_remote_hosts",
+        "How many remote hosts, after aggregation, do the tracked connections go to?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_exporter_rebuild_duration_seconds",
+        "How long did the last full rebuild of the connection table take?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_exporter_rebuild_connections",
+        "How many connections did the last full rebuild of the connection table load?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_exporter_snapshot_build_seconds",
+        "How long did it take to build the last snapshot of the connection table for scraping?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_exporter_connection_memory_bytes",
+        "How much memory is set aside for the connection table's entries, the part --connection-memory-limit caps?",
+        MetricType::Gauge));
+    families.push_back(makeFamily(
+        "conntrack_exporter_shed_connections_total",
+        "How many connections, by state, were left out of or evicted from the table because it reached its memory limit?",
+        MetricType::Counter));
+    return families;
+}
+
+// Adds a series for the source the labels end with:
+ClientMetric& addMetric(MetricFamily& family, const vector<ClientMetric::Label>& labels)
+{
+    family.metric.emplace_back();
+    family.metric.back().label = labels;
+    return family.metric.back();
+}
+
+ClientMetric& addHostMetric(MetricFamily& family, const string& host, const vector<ClientMetric::Label>& labels)
+{
+    auto& metric = addMetric(family, labels);
+    metric.label.insert(metric.label.begin(), {"host", host});
+    return metric;
+}
+
+// Fills in a histogram from per-bucket (not cumulative) counts, the last of
+// which counts the values above every bound:
+void setHistogram(ClientMetric::Histogram& histogram, const uint64_t* counts, const double* bounds, size_t bound_count, double sum)
+{
+    uint64_t cumulative_count = 0;
+    for (size_t bucket = 0; bucket <= bound_count; bucket++)
+    {
+        cumulative_count += counts[bucket];
+        histogram.bucket.emplace_back();
+        histogram.bucket.back().cumulative_count = cumulative_count;
+        histogram.bucket.back().upper_bound = (bucket < bound_count) ? bounds[bucket] : numeric_limits<double>::infinity();
+    }
+    histogram.sample_count = cumulative_count;
+    histogram.sample_sum = sum;
+}
+
+void addHosts(vector<MetricFamily>& families, const TableSnapshot& snapshot, const vector<ClientMetric::Label>& labels)
+{
+    // Only hosts with connections in a state get a series in its family:
+    for (auto& host : snapshot.hosts)
+    {
+        auto& label = *host.label;
+        for (size_t state = 0; state < 4; state++)
+        {
+            auto count = host.counts.counts[state];
+            if (count != 0)
+                addHostMetric(families[OPENING_CONNECTIONS + state], label, labels).gauge.value = count;
+        }
+    }
+}
+
+void addHostTotals(vector<MetricFamily>& families, const TableSnapshot& snapshot, const vector<ClientMetric::Label>& labels)
+{
+    for (auto& page : snapshot.host_totals)
+    {
+        for (auto& host : *page)
+        {
+            auto& label = *host.label;
+            auto& totals = host.totals;
+
+            if (totals.durations.getCount())
+            {
+                setHistogram(addHostMetric(families[CONNECTION_DURATION], label, labels).histogram, totals.durations.counts,
+                    HostTotals::DURATION_BOUNDS, HostTotals::DURATION_BUCKET_COUNT, totals.durations.sum);
+            }
+            if (totals.opening_times.getCount())
+            {
+                setHistogram(addHostMetric(families[CONNECTION_OPENING], label, labels).histogram, totals.opening_times.counts,
+                    HostTotals::OPENING_BOUNDS, HostTotals::OPENING_BUCKET_COUNT, totals.opening_times.sum);
+            }
+            if (totals.sent_packets || totals.received_packets)
+            {
+                const uint64_t values[4] = {totals.sent_bytes, totals.sent_packets, totals.received_bytes, totals.received_packets};
+                for (size_t i = 0; i < 4; i++)
+                    addHostMetric(families[SENT_BYTES + i], label, labels).counter.value = values[i];
+            }
+        }
+    }
+}
+
+void addStats(vector<MetricFamily>& families, const TableSnapshot& snapshot, const vector<ClientMetric::Label>& labels)
+{
+    auto& stats = snapshot.stats;
+
+    addMetric(families[NETLINK_OVERFLOWS], labels).counter.value = snapshot.overflow_count;
+    addMetric(families[RESYNCS], labels).counter.value = snapshot.resync_count;
+
+    const pair<const char*, uint64_t> event_counts[] = {
+        {"new", stats.new_events},
+        {"update", stats.update_events},
+        {"destroy", stats.destroy_events}
+    };
+    for (auto& event_count : event_counts)
+    {
+        auto& metric = addMetric(families[EVENTS], labels);
+        metric.label.insert(metric.label.begin(), {"type", event_count.first});
+        metric.counter.value = event_count.second;
+    }
+
+    addMetric(families[IGNORED_EVENTS], labels).counter.value = stats.ignored_events;
+    addMetric(families[NETLINK_READ_ERRORS], labels).counter.value = stats.read_errors;
+
+    double latency_bounds[TableStats::LATENCY_BUCKET_COUNT];
+    for (size_t bucket = 0; bucket < TableStats::LATENCY_BUCKET_COUNT; bucket++)
+        latency_bounds[bucket] = TableStats::getLatencyBucketBound(bucket);
+    setHistogram(addMetric(families[EVENT_PROCESSING], labels).histogram,
+        stats.latency_buckets, latency_bounds, TableStats::LATENCY_BUCKET_COUNT, stats.latency_sum_ns / 1e9);
+
+    addMetric(families[CONNECTIONS], labels).gauge.value = snapshot.connection_count;
+    addMetric(families[REMOTE_HOSTS], labels).gauge.value = snapshot.hosts.size();
+    addMetric(families[REBUILD_DURATION], labels).gauge.value = stats.rebuild_seconds;
+    addMetric(families[REBUILD_CONNECTIONS], labels).gauge.value = stats.rebuild_connections;
+    addMetric(families[SNAPSHOT_BUILD], labels).gauge.value = stats.snapshot_seconds;
+    addMetric(families[CONNECTION_MEMORY], labels).gauge.value = stats.connection_memory_bytes;
+
+    const char* state_names[4] = {"opening", "open", "closing", "closed"};
+    for (size_t state = 0; state < 4; state++)
+    {
+        auto& metric = addMetric(families[SHED_CONNECTIONS], labels);
+        metric.label.insert(metric.label.begin(), {"state", state_names[state]});
+        metric.counter.value = stats.shed_connections[state];
+    }
+}
+
+} // namespace
+
+uint64_t ConnectionMetrics::getGeneration()
+{
+    lock_guard<mutex> lock(this->snapshot_mutex);
+
+    auto now = chrono::steady_clock::now();
+    if (!this->snapshot || now - this->refreshed_at >= this->min_refresh_interval)
+    {
+        uint64_t request = this->table.requestSnapshot();
+        if (this->namespace_monitor)
+            this->namespace_snapshots = this->namespace_monitor->getSnapshots(SNAPSHOT_TIMEOUT);
+        this->snapshot = this->table.waitForSnapshot(request, SNAPSHOT_TIMEOUT);
+        this->refreshed_at = now;
+    }
+
+    if (!this->namespace_monitor)
+        return this->snapshot->generation;
+
+    // Only ever compared for equality, so mixing is enough:
+    uint64_t generation = this->snapshot->generation ^ (this->namespace_monitor->getVersion() << 48);
+    for (auto& source : this->namespace_snapshots)
+        generation = (generation * 0x100000001B3ULL) ^ source.snapshot->generation;
+    return generation;
+}
+
+void ConnectionMetrics::getSnapshots(shared_ptr<const TableSnapshot>& snapshot, vector<NamespaceMonitor::Source>& namespace_snapshots) const
+{
+    lock_guard<mutex> lock(this->snapshot_mutex);
+    if (this->snapshot)
+    {
+        snapshot = this->snapshot;
+        namespace_snapshots = this->namespace_snapshots;
+        return;
+    }
+
+    snapshot = this->table.waitForSnapshot(this->table.requestSnapshot(), SNAPSHOT_TIMEOUT);
+    if (this->namespace_monitor)
+        namespace_snapshots = this->namespace_monitor->getSnapshots(SNAPSHOT_TIMEOUT);
+}
+
+vector<MetricFamily> ConnectionMetrics::Collect() const
+{
+    shared_ptr<const TableSnapshot> snapshot;
+    vector<NamespaceMonitor::Source> namespace_snapshots;
+    this->getSnapshots(snapshot, namespace_snapshots);
+
+    // With namespaces monitored, every series says which one it's from; the
+    // exporter's own namespace is the empty one:
+    vector<ClientMetric::Label> labels;
+    if (this->namespace_monitor)
+        labels.push_back({"namespace", ""});
+
+    auto families = makeFamilies();
+    addHosts(families, *snapshot, labels);
+    addHostTotals(families, *snapshot, labels);
+    addStats(families, *snapshot, labels);
+
+    // All tables share the one event log:
+    addMetric(families[LOG_EVENTS_DROPPED], {}).counter.value = snapshot->log_dropped_count;
+    addMetric(families[LOG_EVENTS_TRUNCATED], {}).counter.value = snapshot->log_truncated_count;
+
+    for (auto& source : namespace_snapshots)
+    {
+        labels.back().value = source.name;
+        addHosts(families, *source.snapshot, labels);
+        addHostTotals(families, *source.snapshot, labels);
+        addStats(families, *source.snapshot, labels);
+    }
+
+    return families;
+}
+
+} // namespace conntrackex
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#include <prometheus/collectable.h>
+#include <prometheus/metric_family.h>
+
+#include "connection_table.h"
+#include "namespace_monitor.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// Exposes the connection table to Prometheus. Nothing is computed between
+// scrapes: each scrape has the table build a snapshot and builds the metric
+// families from it on the spot.
+class ConnectionMetrics : public prometheus::Collectable
+{
+public:
+
+    ConnectionMetrics(const ConnectionTable& table) : table(table) {}
+
+    // Scrapes within this long of the last refresh keep using the snapshot
+    // that refresh picked up (0 always takes the latest):
+    void setMinRefreshInterval(chrono::milliseconds interval) { this->min_refresh_interval = interval; }
+
+    // Also export the tables of other network namespaces, labelled by
+    // namespace:
+    void setNamespaceMonitor(const NamespaceMonitor* namespace_monitor) { this->namespace_monitor = namespace_monitor; }
+
+    // The generation of the snapshot the next Collect() will report,
+    // refreshing it first if it's due:
+    uint64_t getGeneration();
+
+    vector<prometheus::MetricFamily> Collect() const override;
+
+private:
+
+    void getSnapshots(shared_ptr<const TableSnapshot>& snapshot, vector<NamespaceMonitor::Source>& namespace_snapshots) const;
+
+    const ConnectionTable& table;
+    const NamespaceMonitor* namespace_monitor = nullptr;
+    chrono::milliseconds min_refresh_interval{0};
+    mutable mutex snapshot_mutex;
+    shared_ptr<const TableSnapshot> snapshot;
+    vector<NamespaceMonitor::Source> namespace_snapshots;
+    chrono::steady_clock::time_point refreshed_at;
+};
+
+} // namespace conntrackex
@@ -1,44 +1,98 @@
 #include "connection_table.h"
 
 #include <fcntl.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <time.h>
+#include <chrono>
 #include <iostream>
 #include <algorithm>
 
+#include "network_namespace.h"
+
 
 namespace conntrackex {
 
 using namespace std;
 
-ConnectionTable::ConnectionTable()
+const double HostTotals::DURATION_BOUNDS[] = {0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 1800, 3600};
+const double HostTotals::OPENING_BOUNDS[] = {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 3};
+
+namespace {
+
+// How many host IDs' totals go into each page shared between snapshots:
+const size_t TOTALS_PAGE_SIZE = 256;
+
+// The wall clock in nanoseconds since the epoch, like conntrack's timestamps:
+uint64_t getRealTime()
 {
-    this->attach_handle = makeConntrackHandle();
-    this->rebuild_handle = makeConntrackHandle();
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
+} // namespace
+
 ConnectionTable::~ConnectionTable()
 {
-    nfct_close(this->attach_handle);
-    nfct_close(this->rebuild_handle);
+    if (this->attach_handle)
+        nfct_close(this->attach_handle);
+    if (this->destroy_handle)
+        nfct_close(this->destroy_handle);
+    if (this->rebuild_handle)
+        nfct_close(this->rebuild_handle);
+    if (this->resync_timer_fd >= 0)
+        close(this->resync_timer_fd);
+    if (this->totals_timer_fd >= 0)
+        close(this->totals_timer_fd);
+    if (this->snapshot_request_fd >= 0)
+        close(this->snapshot_request_fd);
 }
 
-nfct_handle* ConnectionTable::makeConntrackHandle()
+void ConnectionTable::setEventGroups(const string& event_groups)
 {
-    uint32_t family = AF_INET;
-
-    // HACK: Initialize conntrack; see https://github.com/markusa/netsniff-ng_filter/blob/master/src/flowtop.c#L850-L861
-    auto dummy_handle = nfct_open(NFNL_SUBSYS_CTNETLINK, NFCT_ALL_CT_GROUPS);
-    if (!dummy_handle)
-        throw runtime_error("Unable to open NetFilter socket. (Does the current user have sufficient privileges?)");
-    nfct_callback_register(dummy_handle, NFCT_T_ALL, ConnectionTable::nfct_callback_dummy, NULL);
-	nfct_query(dummy_handle, NFCT_Q_DUMP, &family);
-	nfct_close(dummy_handle);
+    if (event_groups == "all")
+        this->event_groups = EventGroups::ALL;
+    else if (event_groups == "new-destroy")
+        this->event_groups = EventGroups::NEW_DESTROY;
+    else if (event_groups == "transitions")
+        this->event_groups = EventGroups::TRANSITIONS;
+    else
+        throw runtime_error("Unknown event groups '" + event_groups + "' (expected all, new-destroy or transitions).");
+}
 
-    auto handle = nfct_open(NFNL_SUBSYS_CTNETLINK, NFCT_ALL_CT_GROUPS);
+nfct_handle* ConnectionTable::makeConntrackHandle(unsigned groups)
+{
+    // Only opens a socket: the one dump the table needs comes later, from
+    // rebuild(), and nothing is ever flushed from the kernel's table.
+    auto handle = nfct_open(NFNL_SUBSYS_CTNETLINK, groups);
     if (!handle)
         throw runtime_error("Unable to open NetFilter socket. (Does the current user have sufficient privileges?)");
 
-    nfct_query(handle, NFCT_Q_FLUSH, &family);
+    return handle;
+}
+
+size_t ConnectionTable::getKernelConnectionCount()
+{
+    // Per network namespace, like the table itself:
+    FILE* file = fopen("/proc/sys/net/netfilter/nf_conntrack_count", "r");
+    if (!file)
+        return 0;
+
+    unsigned long count = 0;
+    if (fscanf(file, "%lu", &count) != 1)
+        count = 0;
+    fclose(file);
+    return count;
+}
 
+void ConnectionTable::attachFilter(nfct_handle* handle, bool filter_states)
+{
     auto filter = nfct_filter_create();
     if (!filter)
         throw runtime_error("Unable to create netfilter_conntrack filter!");
@@ -46,116 +100,969 @@ nfct_handle* ConnectionTable::makeConntrackHandle()
     // Filter in only TCP entries:
     nfct_filter_add_attr_u32(filter, NFCT_FILTER_L4PROTO, IPPROTO_TCP);
 
+    // Only let through the states that start one of the exported states.
+    // Opening has SYN_SENT (SYN_RECV follows it), closing has whichever of
+    // FIN_WAIT or CLOSE_WAIT comes first (LAST_ACK and TIME_WAIT follow):
+    if (filter_states)
+    {
+        const uint8_t states[] = {
+            TCP_CONNTRACK_SYN_SENT,
+            TCP_CONNTRACK_ESTABLISHED,
+            TCP_CONNTRACK_FIN_WAIT,
+            TCP_CONNTRACK_CLOSE_WAIT,
+            TCP_CONNTRACK_CLOSE
+        };
+        for (auto state : states)
+        {
+            struct nfct_filter_proto filter_proto = {IPPROTO_TCP, state};
+            nfct_filter_add_attr(filter, NFCT_FILTER_L4PROTO_STATE, &filter_proto);
+        }
+    }
+
+    // Filter out ignored hosts wherever the kernel can do it for us. Which
+    // rules it can take depends on the local addresses, so this is redone
+    // whenever they change:
+    auto kernel_rules = this->getKernelRules();
+    HostFilter::compile(filter, kernel_rules);
+    this->kernel_rule_count = kernel_rules.size();
+    if (this->debugging && handle == this->attach_handle)
+        cout << "[DEBUG] Ignoring " << this->kernel_rule_count << " host rule(s) in the kernel socket filter" << endl;
+
     if (nfct_filter_attach(nfct_fd(handle), filter) < 0)
         throw runtime_error("Unable to attach netfilter_conntrack filter to handle!");
 
     nfct_filter_destroy(filter);
+}
 
-    return handle;
+void ConnectionTable::setMemoryLimit(size_t bytes)
+{
+    // The map grows by doubling and briefly holds both arrays while it
+    // does, so the last growth step must fit one and a half times over:
+    size_t capacity = ConnectionMap::getMinCapacity();
+    while (capacity * 2 * ConnectionMap::getSlotSize() * 3 / 2 <= bytes)
+        capacity *= 2;
+    this->max_connections = ConnectionMap::getMaxSize(capacity);
+
+    if (this->debugging)
+        cout << "[DEBUG] Tracking at most " << this->max_connections << " connections" << endl;
+}
+
+void ConnectionTable::setNetworkNamespace(int namespace_fd)
+{
+    this->namespace_fd = namespace_fd;
+    this->local_addresses.setNetworkNamespace(namespace_fd);
 }
 
 void ConnectionTable::attach()
 {
-    // Switch the netfilter socket to non-blocking to prevent nfct_catch from
+    // Sockets belong to the namespace they were opened in, so everything is
+    // opened from inside the table's namespace:
+    NetworkNamespaceSwitch in_namespace(this->namespace_fd);
+
+    // DESTROY events carry the state a connection ended in, which is often
+    // one the TRANSITIONS filter leaves out, so they get a socket of their
+    // own there:
+    switch (this->event_groups)
+    {
+        case EventGroups::ALL:
+            this->attach_handle = makeConntrackHandle(NFCT_ALL_CT_GROUPS);
+            break;
+        case EventGroups::NEW_DESTROY:
+            this->attach_handle = makeConntrackHandle(NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_DESTROY);
+            break;
+        case EventGroups::TRANSITIONS:
+            this->attach_handle = makeConntrackHandle(NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_UPDATE);
+            this->destroy_handle = makeConntrackHandle(NF_NETLINK_CONNTRACK_DESTROY);
+            break;
+    }
+
+    // The rebuild handle only ever receives dumps, so it joins no event groups:
+    this->rebuild_handle = makeConntrackHandle(0);
+
+    // Subscribe before loading, so that no change made in between is missed.
+    // Notifications for changes the load already saw are no-ops:
+    this->local_addresses.subscribe();
+    this->local_addresses.load(this->debugging);
+    if (this->event_recorder)
+        this->event_recorder->writeHeader(this->local_addresses);
+
+    this->attachFilters();
+
+    // Switch the netfilter sockets to non-blocking to prevent nfct_catch from
     // taking control. See https://www.spinics.net/lists/netfilter-devel/msg20952.html
-    int fd = nfct_fd(this->attach_handle);
-    int flags = fcntl(fd, F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    if (fcntl(fd, F_SETFL, flags) != 0)
-        throw runtime_error("Error setting the NetFilter socket to non-blocking mode.");
+    this->setNonBlocking(this->attach_handle);
+    if (this->destroy_handle)
+        this->setNonBlocking(this->destroy_handle);
 
+    // A bigger receive buffer lets the sockets absorb longer event bursts.
+    // SO_RCVBUFFORCE can go past rmem_max but needs CAP_NET_ADMIN:
+    for (auto handle : {this->attach_handle, this->destroy_handle})
+    {
+        if (!handle || this->receive_buffer_size <= 0)
+            continue;
+
+        int fd = nfct_fd(handle);
+        int size = this->receive_buffer_size;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0 &&
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0)
+            throw runtime_error("Error setting the NetFilter socket receive buffer size.");
+
+        if (this->debugging)
+        {
+            socklen_t length = sizeof(size);
+            getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &length);
+            cout << "[DEBUG] NetFilter socket receive buffer size: " << size << " bytes" << endl;
+        }
+    }
+
+    // The event sockets were subscribed before the dump starts, so changes
+    // made while it runs queue up there and are applied after it, instead
+    // of being lost:
     this->rebuild();
 
-    nfct_callback_register(this->attach_handle, NFCT_T_ALL, ConnectionTable::nfct_callback_attach, this);
+    // Now that the dump has shown whether the kernel can apply ignore rules
+    // the way we do, give them to it:
+    this->attachFilters();
+
+    // Later dumps are resyncs that must not block event processing:
+    this->setNonBlocking(this->rebuild_handle);
+
+    nfct_callback_register2(this->attach_handle, NFCT_T_ALL, ConnectionTable::nfct_callback_attach, this);
+    if (this->destroy_handle)
+        nfct_callback_register2(this->destroy_handle, NFCT_T_ALL, ConnectionTable::nfct_callback_attach, this);
+
+    if (this->resync_interval > 0)
+        this->resync_timer_fd = makeTimer(this->resync_interval);
+    if (this->host_totals_expiry > 0)
+        this->totals_timer_fd = makeTimer(this->host_totals_expiry);
+
+    this->snapshot_request_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->snapshot_request_fd < 0)
+        throw runtime_error("Unable to create an eventfd.");
 }
 
-void ConnectionTable::update()
+void ConnectionTable::attachFilters()
 {
-    nfct_catch(this->attach_handle);
+    // Only the event sockets are filtered. A socket filter only sees the
+    // first message of each datagram, and a dump packs many entries into
+    // one, so filtering the rebuild handle would drop whole batches of
+    // entries (and a resync would then evict them). processDumpEntry()
+    // filters dumps instead.
+    this->attachFilter(this->attach_handle, this->event_groups == EventGroups::TRANSITIONS);
+    if (this->destroy_handle)
+        this->attachFilter(this->destroy_handle);
 }
 
-void ConnectionTable::rebuild()
+vector<IgnoreRule> ConnectionTable::getKernelRules() const
 {
-    this->connections.clear();
+    if (!this->is_table_loaded || this->has_translated_connections)
+        return {};
 
-    nfct_callback_register(this->rebuild_handle, NFCT_T_ALL, ConnectionTable::nfct_callback_rebuild, this);
+    return this->ignored_hosts.getKernelRules(this->local_addresses);
+}
+
+void ConnectionTable::withdrawKernelRules()
+{
+    this->has_translated_connections = true;
+    if (this->kernel_rule_count == 0)
+        return;
 
-    this->is_rebuilding = true;
     if (this->debugging)
-        cout << "[DEBUG] Rebuilding connection table" << endl;
+        cout << "[DEBUG] Seen a NATed or forwarded connection, taking the ignore rules out of the kernel socket filters" << endl;
+
+    // The rules may have dropped events of connections we do track, so pick
+    // those up from a dump. One already running may have missed them:
+    this->attachFilters();
+    if (this->is_resyncing)
+        this->is_resync_pending = true;
+    else
+        this->startResync();
+}
+
+void ConnectionTable::setNonBlocking(nfct_handle* handle)
+{
+    int fd = nfct_fd(handle);
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) != 0)
+        throw runtime_error("Error setting the NetFilter socket to non-blocking mode.");
+}
+
+int ConnectionTable::makeTimer(unsigned seconds)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        throw runtime_error("Unable to create a timer.");
+
+    struct itimerspec interval = {};
+    interval.it_interval.tv_sec = seconds;
+    interval.it_value.tv_sec = seconds;
+    if (timerfd_settime(fd, 0, &interval, nullptr) != 0)
+        throw runtime_error("Unable to start a timer.");
+    return fd;
+}
+
+void ConnectionTable::update(nfct_handle* handle)
+{
+    // The socket is non-blocking, so this processes everything that's queued.
+    // ENOBUFS means the kernel had to drop events because the socket buffer
+    // was full: keep draining, then reconcile the table with a fresh dump.
+    while (nfct_catch(handle) == -1)
+    {
+        if (errno != ENOBUFS)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                this->stats.read_errors++;
+                this->generation++;
+            }
+            break;
+        }
+
+        this->overflow_count++;
+        this->generation++;
+
+        if (this->debugging)
+            cout << "[DEBUG] NetFilter socket overflowed, events were lost" << endl;
+
+        if (!this->is_resyncing)
+            this->startResync();
+    }
+    this->checkRecorder();
+}
+
+vector<int> ConnectionTable::getFileDescriptors()
+{
+    vector<int> fds = {
+        nfct_fd(this->attach_handle),
+        nfct_fd(this->rebuild_handle),
+        this->local_addresses.getFileDescriptor()
+    };
+    if (this->destroy_handle)
+        fds.push_back(nfct_fd(this->destroy_handle));
+    if (this->resync_timer_fd >= 0)
+        fds.push_back(this->resync_timer_fd);
+    if (this->totals_timer_fd >= 0)
+        fds.push_back(this->totals_timer_fd);
+    fds.push_back(this->snapshot_request_fd);
+    return fds;
+}
+
+void ConnectionTable::handleEvents(int fd)
+{
+    if (fd == nfct_fd(this->attach_handle))
+        this->update(this->attach_handle);
+    else if (fd == nfct_fd(this->rebuild_handle))
+        this->updateResync();
+    else if (fd == this->local_addresses.getFileDescriptor())
+        this->updateLocalAddresses();
+    else if (this->destroy_handle && fd == nfct_fd(this->destroy_handle))
+    {
+        // A connection's NEW is queued before its DESTROY, so catching up on
+        // the other socket first keeps short connections from coming back
+        // to life:
+        this->update(this->attach_handle);
+        this->update(this->destroy_handle);
+    }
+    else if (fd == this->resync_timer_fd)
+    {
+        uint64_t expirations;
+        if (read(this->resync_timer_fd, &expirations, sizeof(expirations)) > 0 && !this->is_resyncing)
+            this->startResync();
+    }
+    else if (fd == this->totals_timer_fd)
+    {
+        uint64_t expirations;
+        if (read(this->totals_timer_fd, &expirations, sizeof(expirations)) > 0)
+            this->expireHostTotals();
+    }
+    else if (fd == this->snapshot_request_fd)
+    {
+        uint64_t requests;
+        if (read(this->snapshot_request_fd, &requests, sizeof(requests)) > 0)
+            this->serveSnapshotRequests();
+    }
+}
+
+void ConnectionTable::updateLocalAddresses()
+{
+    vector<uint32_t> changed_addresses;
+    uint64_t version = this->local_addresses.getVersion();
+    bool reloaded = this->local_addresses.update(changed_addresses);
+    if (this->local_addresses.getVersion() == version)
+        return;
+
+    if (this->event_recorder)
+        this->event_recorder->recordAddresses(this->local_addresses);
+
+    // A new address inside an ignored range takes that rule out of the
+    // kernel filter, which until now dropped the address's events too.
+    // Swap in filters that let them through, then pick up whatever was
+    // dropped meanwhile from a dump:
+    bool had_kernel_rules = (this->kernel_rule_count > 0);
+    this->attachFilters();
+    if (had_kernel_rules && !this->is_resyncing)
+        this->startResync();
+
+    this->reclassifyConnections(reloaded, changed_addresses);
+}
+
+void ConnectionTable::replaceLocalAddresses(const vector<uint32_t>& ipv4_addresses, const vector<IPv6Address>& ipv6_addresses)
+{
+    this->local_addresses.clear();
+    for (auto address : ipv4_addresses)
+        this->local_addresses.add(address);
+    for (auto& address : ipv6_addresses)
+        this->local_addresses.add(address);
+
+    this->reclassifyConnections(true, {});
+}
+
+void ConnectionTable::reclassifyConnections(bool all, const vector<uint32_t>& changed_addresses)
+{
+    if (!all && changed_addresses.empty())
+        return;
+
+    // Only connections involving an address that changed can end up with a
+    // different remote endpoint; move just those between hosts:
+    for (auto& entry : this->connections)
+    {
+        auto& connection = entry.value.connection;
+        if (!all && none_of(changed_addresses.begin(), changed_addresses.end(),
+                            [&](uint32_t address) { return connection.involvesAddress(address); }))
+            continue;
+
+        Connection reclassified = connection;
+        reclassified.resolveRemoteEndpoint(this->local_addresses);
+        if (reclassified.getRemoteEndpoint() == connection.getRemoteEndpoint() &&
+            reclassified.isInbound() == connection.isInbound())
+            continue;
+
+        this->countConnection(entry.value, -1);
+        connection = reclassified;
+        uint32_t old_host_id = entry.value.host_id;
+        entry.value.host_id = this->host_ids.acquire(this->host_aggregator->aggregate(connection));
+        this->host_ids.release(old_host_id);
+        this->countConnection(entry.value, 1);
+    }
+}
+
+void ConnectionTable::rebuild()
+{
+    this->beginDump(false);
+
+    // Size the table for the dump up front (with room for the connections
+    // opened meanwhile) rather than rehashing it over and over:
+    size_t kernel_count = getKernelConnectionCount();
+    this->connections.reserve(min(kernel_count + kernel_count / 8, this->max_connections));
+
+    nfct_callback_register2(this->rebuild_handle, NFCT_T_ALL, ConnectionTable::nfct_callback_rebuild, this);
 
     uint32_t family = AF_INET;
     nfct_query(this->rebuild_handle, NFCT_Q_DUMP, &family);
+    this->checkRecorder();
+
+    this->endDump(true);
+}
+
+void ConnectionTable::checkRecorder() const
+{
+    // The callbacks stop at a recording error rather than throw through
+    // libnetfilter_conntrack; raise it here, once nfct_catch() has returned:
+    if (this->event_recorder && this->event_recorder->hasFailed())
+        throw runtime_error(this->event_recorder->getError());
+}
 
+void ConnectionTable::startResync()
+{
+    this->beginDump(true);
+
+    uint32_t family = AF_INET;
+    if (nfct_send(this->rebuild_handle, NFCT_Q_DUMP, &family) == -1)
+    {
+        cerr << "[WARNING] Unable to request a conntrack dump for resyncing." << endl;
+        this->endDump(false);
+    }
+}
+
+void ConnectionTable::updateResync()
+{
+    if (!this->is_resyncing)
+        return;
+
+    this->is_rebuilding = true;
+    int result = nfct_catch(this->rebuild_handle);
     this->is_rebuilding = false;
+    this->checkRecorder();
+
+    if (result == -1 && errno == EAGAIN)
+        return; // more to come
+
+    if (result == -1 && errno == ENOBUFS)
+    {
+        // The dump itself overflowed the socket; start over:
+        if (this->debugging)
+            cout << "[DEBUG] Resync dump overflowed, restarting it" << endl;
+        this->startResync();
+        return;
+    }
+
+    if (result == -1)
+    {
+        // Without a complete dump we can't tell which entries are stale:
+        this->stats.read_errors++;
+        cerr << "[WARNING] Conntrack dump for resyncing failed: " << strerror(errno) << endl;
+        this->endDump(false);
+        return;
+    }
+
+    this->endDump(true);
+}
+
+void ConnectionTable::beginDump(bool resync)
+{
+    if (this->event_recorder)
+        this->event_recorder->recordDumpStart(resync);
+
+    if (resync)
+    {
+        // Entries the dump confirms, and entries touched by live events while
+        // it runs, are stamped with the new epoch; whatever is left with an
+        // older one once the dump completes no longer exists in the kernel.
+        this->resync_epoch++;
+        this->is_resyncing = true;
+        this->resync_count++;
+        this->generation++;
+
+        if (this->debugging)
+            cout << "[DEBUG] Resyncing connection table" << endl;
+        return;
+    }
+
+    for (auto& entry : this->connections)
+    {
+        this->countConnection(entry.value, -1);
+        this->host_ids.release(entry.value.host_id);
+    }
+    this->connections.clear();
+    this->generation++;
+    this->rebuild_started_at = chrono::steady_clock::now();
+
     if (this->debugging)
-        cout << "[DEBUG] Finished rebuilding connection table" << endl;
+        cout << "[DEBUG] Rebuilding connection table" << endl;
+}
+
+void ConnectionTable::processDumpEntry(const nf_conntrack* ct)
+{
+    // Dumps aren't filtered in the kernel, see attachFilters():
+    if (!Connection::isTrackable(ct) || nfct_get_attr_u8(ct, ATTR_L4PROTO) != IPPROTO_TCP)
+        return;
+
+    Connection connection(ct, this->local_addresses);
+
+    // Dumped entries are new to an empty table, but during a resync they
+    // update whatever we already have:
+    auto type = (this->is_resyncing && this->connections.find(connection.getKey())) ? NFCT_T_UPDATE : NFCT_T_NEW;
+
+    bool was_rebuilding = this->is_rebuilding;
+    this->is_rebuilding = true;
+    this->updateConnection(type, connection, ct);
+    this->is_rebuilding = was_rebuilding;
+}
+
+void ConnectionTable::endDump(bool complete)
+{
+    if (this->event_recorder)
+        this->event_recorder->recordDumpEnd(complete);
+
+    if (!this->is_resyncing)
+    {
+        this->is_table_loaded = true;
+        this->stats.rebuild_seconds = chrono::duration<double>(chrono::steady_clock::now() - this->rebuild_started_at).count();
+        this->stats.rebuild_connections = this->connections.size();
+        if (this->debugging)
+            cout << "[DEBUG] Finished rebuilding connection table" << endl;
+        return;
+    }
+
+    if (complete)
+        this->finishResync();
+    else
+        this->is_resyncing = false;
+
+    if (this->is_resync_pending)
+    {
+        this->is_resync_pending = false;
+        this->startResync();
+    }
+}
+
+void ConnectionTable::finishResync()
+{
+    vector<ConnectionKey> stale_keys;
+    for (auto& entry : this->connections)
+    {
+        if (entry.value.resync_epoch != this->resync_epoch)
+            stale_keys.push_back(entry.key);
+    }
+
+    for (auto& key : stale_keys)
+        this->removeConnection(key);
+
+    this->is_resyncing = false;
+    if (this->debugging)
+        cout << "[DEBUG] Finished resyncing connection table, removed " << stale_keys.size() << " stale connections" << endl;
+}
+
+void ConnectionTable::publishSnapshot()
+{
+    auto start = chrono::steady_clock::now();
+    auto snapshot = make_shared<TableSnapshot>();
+    snapshot->generation = this->generation;
+    snapshot->connection_count = this->connections.size();
+    snapshot->overflow_count = this->overflow_count;
+    snapshot->resync_count = this->resync_count;
+    snapshot->log_dropped_count = this->event_log ? this->event_log->getDroppedCount() : 0;
+    snapshot->log_truncated_count = this->event_log ? this->event_log->getTruncatedCount() : 0;
+    this->stats.connection_memory_bytes = this->connections.capacity() * ConnectionMap::getSlotSize();
+    snapshot->stats = this->stats;
+    snapshot->hosts.reserve(this->host_count);
+    for (uint32_t id = 0; id < this->host_counts.size(); id++)
+    {
+        if (!this->host_counts[id].isEmpty())
+            snapshot->hosts.push_back({this->host_ids.getHost(id), this->host_ids.getLabel(id), this->host_counts[id]});
+    }
+    for (size_t page = 0; page < this->is_totals_page_changed.size(); page++)
+    {
+        if (!this->is_totals_page_changed[page])
+            continue;
+
+        auto totals = make_shared<vector<TableSnapshot::Totals>>();
+        size_t end_id = min((page + 1) * TOTALS_PAGE_SIZE, this->has_host_totals.size());
+        for (uint32_t id = page * TOTALS_PAGE_SIZE; id < end_id; id++)
+        {
+            if (this->has_host_totals[id])
+                totals->push_back({this->host_ids.getHost(id), this->host_ids.getLabel(id), this->host_totals[id]});
+        }
+        this->totals_pages[page] = move(totals);
+        this->is_totals_page_changed[page] = false;
+    }
+    snapshot->host_totals = this->totals_pages;
+
+    // Deltas go out first, so that every published snapshot is covered by
+    // the log:
+    if (this->delta_log)
+        this->publishDeltas();
+
+    atomic_store(&this->snapshot, shared_ptr<const TableSnapshot>(move(snapshot)));
+    this->published_generation = this->generation;
+    this->stats.snapshot_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void ConnectionTable::countConnection(const TrackedConnection& entry, int delta)
+{
+    if (!entry.connection.hasState())
+        return;
+
+    if (entry.host_id >= this->host_counts.size())
+        this->host_counts.resize(this->host_ids.getIdLimit());
+
+    auto& host = this->host_counts[entry.host_id];
+    bool was_empty = host.isEmpty();
+    host.counts[static_cast<size_t>(this->getCountedState(entry.connection))] += delta;
+    host.generation = ++this->generation;
+    if (host.isEmpty() != was_empty)
+        this->host_count += was_empty ? 1 : -1;
+
+    if (this->delta_log)
+        this->markHostChanged(entry.host_id);
+}
+
+void ConnectionTable::markHostChanged(uint32_t host_id)
+{
+    if (host_id >= this->is_host_changed.size())
+        this->is_host_changed.resize(this->host_ids.getIdLimit());
+    if (this->is_host_changed[host_id])
+        return;
+
+    // The ID must still be this host's when the change is published, even
+    // if its last connection is gone by then:
+    this->is_host_changed[host_id] = true;
+    this->host_ids.acquire(host_id);
+    this->changed_host_ids.push_back(host_id);
+}
+
+uint64_t ConnectionTable::requestSnapshot() const
+{
+    uint64_t request = ++this->snapshot_requests;
+    if (this->snapshot_request_fd < 0)
+        return request;
+
+    uint64_t wakeup = 1;
+    if (write(this->snapshot_request_fd, &wakeup, sizeof(wakeup)) < 0)
+        cerr << "[WARNING] Unable to request a snapshot of the connection table." << endl;
+    return request;
+}
+
+shared_ptr<const TableSnapshot> ConnectionTable::waitForSnapshot(uint64_t request, chrono::milliseconds timeout) const
+{
+    if (this->snapshot_request_fd >= 0)
+    {
+        unique_lock<mutex> lock(this->served_snapshots_mutex);
+        this->snapshot_served.wait_for(lock, timeout, [&]() { return this->served_snapshots >= request; });
+    }
+    return this->getSnapshot();
+}
+
+void ConnectionTable::serveSnapshotRequests()
+{
+    // Every request made up to here is answered by the snapshot below, and
+    // an unchanged table is answered by the one already published:
+    uint64_t requests = this->snapshot_requests;
+    if (this->hasUnpublishedChanges())
+        this->publishSnapshot();
+
+    {
+        lock_guard<mutex> lock(this->served_snapshots_mutex);
+        this->served_snapshots = requests;
+    }
+    this->snapshot_served.notify_all();
+}
+
+void ConnectionTable::publishDeltas()
+{
+    vector<HostDelta> deltas(this->changed_host_ids.size());
+    for (size_t i = 0; i < deltas.size(); i++)
+    {
+        uint32_t id = this->changed_host_ids[i];
+        auto& counts = this->host_counts[id];
+        deltas[i].generation = counts.generation;
+        deltas[i].host = this->host_ids.getHost(id);
+        deltas[i].label = this->host_ids.getLabel(id);
+        copy(begin(counts.counts), end(counts.counts), deltas[i].counts);
+
+        this->is_host_changed[id] = false;
+        this->host_ids.release(id);
+    }
+    this->changed_host_ids.clear();
+
+    this->delta_log->append(deltas, this->generation);
+}
+
+bool ConnectionTable::makeRoom(const Connection& connection)
+{
+    if (this->connections.size() < this->max_connections)
+        return true;
+
+    // Connections still opening are the first to go, starting with the new
+    // one itself:
+    if (!connection.hasState() || connection.getState() == ConnectionState::OPENING)
+        return false;
+
+    // Look for one in the table, a bounded stretch at a time. The cursor
+    // moves on so that eviction spreads over the whole table:
+    const size_t MAX_EVICTION_PROBES = 256;
+    size_t capacity = this->connections.capacity();
+    for (size_t probe = 0; probe < MAX_EVICTION_PROBES; probe++)
+    {
+        this->eviction_cursor = (this->eviction_cursor + 1) % capacity;
+        auto entry = this->connections.getEntryAt(this->eviction_cursor);
+        if (!entry || !entry->value.connection.hasState() ||
+            entry->value.connection.getState() != ConnectionState::OPENING)
+            continue;
+
+        this->stats.shed_connections[static_cast<size_t>(ConnectionState::OPENING)]++;
+        ConnectionKey key = entry->key;
+        this->removeConnection(key);
+        return true;
+    }
+
+    return false;
+}
+
+void ConnectionTable::removeConnection(const ConnectionKey& key)
+{
+    auto entry = this->connections.find(key);
+    this->countConnection(*entry, -1);
+    this->host_ids.release(entry->host_id);
+    this->connections.erase(key);
+}
+
+ConnectionState ConnectionTable::getCountedState(const Connection& connection) const
+{
+    // Without UPDATE events, states in between NEW and DESTROY are unknown:
+    if (this->event_groups == EventGroups::NEW_DESTROY)
+        return ConnectionState::OPEN;
+
+    return connection.getState();
+}
+
+void ConnectionTable::processEvent(enum nf_conntrack_msg_type type, const nf_conntrack* ct)
+{
+    // Every event changes the counters below, even when the connection
+    // counts stay the same:
+    this->generation++;
+    if (type == NFCT_T_NEW)
+        this->stats.new_events++;
+    else if (type == NFCT_T_UPDATE)
+        this->stats.update_events++;
+    else if (type == NFCT_T_DESTROY)
+        this->stats.destroy_events++;
+
+    if (!Connection::isTrackable(ct))
+        return;
+
+    // Reading the clock costs a noticeable share of an event, so only a
+    // sample of events is timed:
+    bool timed = (++this->event_count % TableStats::LATENCY_SAMPLE_INTERVAL) == 0;
+    chrono::steady_clock::time_point start;
+    if (timed)
+        start = chrono::steady_clock::now();
+
+    Connection connection(ct, this->local_addresses);
+    this->updateConnection(type, connection, ct);
+
+    if (timed)
+        this->stats.recordLatency(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+void ConnectionTable::recordTimings(enum nf_conntrack_msg_type type, const TrackedConnection& old_entry, const Connection& connection)
+{
+    if (type == NFCT_T_DESTROY)
+    {
+        if (!connection.hasTimestamps())
+            return;
+
+        auto start = connection.getStartTimestamp();
+        auto stop = connection.getStopTimestamp();
+        if (stop <= start)
+            return;
+
+        this->getHostTotals(old_entry.host_id).durations.observe(HostTotals::DURATION_BOUNDS, (stop - start) / 1e9);
+        return;
+    }
+
+    // The update that completes the handshake carries no timestamps, so it
+    // is measured from the start stored with the entry to when we hear
+    // about it:
+    bool opened = old_entry.connection.hasState() && old_entry.connection.getState() == ConnectionState::OPENING &&
+                  connection.hasState() && connection.getState() == ConnectionState::OPEN;
+    if (!opened || !old_entry.start_time)
+        return;
+
+    uint64_t now = getRealTime();
+    if (now <= old_entry.start_time)
+        return;
+
+    this->getHostTotals(old_entry.host_id).opening_times.observe(HostTotals::OPENING_BOUNDS, (now - old_entry.start_time) / 1e9);
+}
+
+void ConnectionTable::recordTraffic(const Connection* old_connection, const Connection& connection, uint32_t host_id)
+{
+    // Counters only go down if the kernel reused the entry, in which case
+    // everything it counted is new:
+    auto delta = [](uint64_t old_value, uint64_t new_value) { return (new_value >= old_value) ? new_value - old_value : new_value; };
+    bool had_counters = old_connection && old_connection->hasCounters();
+    uint64_t original_bytes = delta(had_counters ? old_connection->getOriginalBytes() : 0, connection.getOriginalBytes());
+    uint64_t original_packets = delta(had_counters ? old_connection->getOriginalPackets() : 0, connection.getOriginalPackets());
+    uint64_t reply_bytes = delta(had_counters ? old_connection->getReplyBytes() : 0, connection.getReplyBytes());
+    uint64_t reply_packets = delta(had_counters ? old_connection->getReplyPackets() : 0, connection.getReplyPackets());
+    if (!original_packets && !reply_packets)
+        return;
+
+    // The original direction is whichever way the connection was opened.
+    // Counting marks the totals as active, so they aren't expired while
+    // traffic keeps coming:
+    auto& totals = this->getHostTotals(host_id);
+    if (connection.isInbound())
+    {
+        totals.received_bytes += original_bytes;
+        totals.received_packets += original_packets;
+        totals.sent_bytes += reply_bytes;
+        totals.sent_packets += reply_packets;
+    }
+    else
+    {
+        totals.sent_bytes += original_bytes;
+        totals.sent_packets += original_packets;
+        totals.received_bytes += reply_bytes;
+        totals.received_packets += reply_packets;
+    }
+}
+
+HostTotals& ConnectionTable::getHostTotals(uint32_t host_id)
+{
+    if (host_id >= this->host_totals.size())
+    {
+        this->host_totals.resize(this->host_ids.getIdLimit());
+        this->has_host_totals.resize(this->host_ids.getIdLimit());
+    }
+
+    // Totals outlive the host's connections, so they keep its ID:
+    if (!this->has_host_totals[host_id])
+    {
+        this->has_host_totals[host_id] = true;
+        this->host_ids.acquire(host_id);
+    }
+    this->markTotalsChanged(host_id);
+    return this->host_totals[host_id];
 }
 
-bool ConnectionTable::isIgnoredHost(const string& host) const
+void ConnectionTable::markTotalsChanged(uint32_t host_id)
 {
-    return (find(this->ignored_hosts.begin(),
-                 this->ignored_hosts.end(),
-                 host) != this->ignored_hosts.end());
+    if (host_id >= this->host_totals_epoch.size())
+        this->host_totals_epoch.resize(this->host_ids.getIdLimit());
+    this->host_totals_epoch[host_id] = this->totals_epoch;
+
+    size_t page = host_id / TOTALS_PAGE_SIZE;
+    if (page >= this->is_totals_page_changed.size())
+    {
+        this->is_totals_page_changed.resize(page + 1);
+        this->totals_pages.resize(page + 1, make_shared<const vector<TableSnapshot::Totals>>());
+    }
+    this->is_totals_page_changed[page] = true;
 }
 
-int ConnectionTable::nfct_callback_attach(enum nf_conntrack_msg_type type, struct nf_conntrack* ct, void* data)
+void ConnectionTable::expireHostTotals()
+{
+    // Runs once per expiry interval, so totals that haven't changed since
+    // the previous run, of a host without connections, have been idle for
+    // at least that long:
+    size_t expired = 0;
+    for (uint32_t id = 0; id < this->has_host_totals.size(); id++)
+    {
+        if (!this->has_host_totals[id] || this->host_totals_epoch[id] == this->totals_epoch)
+            continue;
+        if (id < this->host_counts.size() && !this->host_counts[id].isEmpty())
+            continue;
+
+        this->markTotalsChanged(id);
+        this->has_host_totals[id] = false;
+        this->host_totals[id] = HostTotals();
+        this->host_ids.release(id);
+        expired++;
+    }
+    this->totals_epoch++;
+
+    if (expired > 0)
+        this->generation++;
+    if (this->debugging)
+        cout << "[DEBUG] Expired the totals of " << expired << " idle host(s)" << endl;
+}
+
+int ConnectionTable::nfct_callback_attach(const struct nlmsghdr* message, enum nf_conntrack_msg_type type, struct nf_conntrack* ct, void* data)
 {
-    Connection connection(ct);
     auto table = static_cast<ConnectionTable*>(data);
-    table->updateConnection(type, connection);
+    if (table->event_recorder)
+    {
+        table->event_recorder->recordEvent(message);
+        if (table->event_recorder->hasFailed())
+            return NFCT_CB_STOP;
+    }
 
+    table->processEvent(type, ct);
     return NFCT_CB_CONTINUE;
 }
 
-int ConnectionTable::nfct_callback_rebuild(enum nf_conntrack_msg_type type, struct nf_conntrack* ct, void* data)
+int ConnectionTable::nfct_callback_rebuild(const struct nlmsghdr* message, enum nf_conntrack_msg_type /*type*/, struct nf_conntrack* ct, void* data)
 {
-    if (type == NFCT_T_UPDATE)
-        type = NFCT_T_NEW;
-
-    Connection connection(ct);
     auto table = static_cast<ConnectionTable*>(data);
-    table->updateConnection(type, connection);
+    if (table->event_recorder)
+    {
+        table->event_recorder->recordDumpEntry(message);
+        if (table->event_recorder->hasFailed())
+            return NFCT_CB_STOP;
+    }
 
+    table->processDumpEntry(ct);
     return NFCT_CB_CONTINUE;
 }
 
-void ConnectionTable::updateConnection(enum nf_conntrack_msg_type type, Connection& connection)
+void ConnectionTable::updateConnection(enum nf_conntrack_msg_type type, Connection& connection, const nf_conntrack* ct)
 {
     connection.setEventType(type);
 
-    if (this->isIgnoredHost(connection.getRemoteHost()))
+    if (connection.isTranslated() && !this->has_translated_connections)
+        this->withdrawKernelRules();
+
+    if (this->isIgnoredHost(connection.getRemoteEndpoint()))
     {
+        if (!this->is_rebuilding)
+            this->stats.ignored_events++;
         if (this->debugging)
         {
             cout << "[DEBUG] Remote host is present on the ignore list, ignoring connection:" << endl;
-            cout << "\t" << connection.toNetFilterString() << endl;
+            cout << "\t" << Connection::toNetFilterString(ct, type) << endl;
         }
         return;
     }
 
     // Log the event:
-    if (this->log_events && !this->is_rebuilding)
+    if (this->event_log && !this->is_rebuilding)
+        this->event_log->push(connection, ct, type);
+
+    // Look up an existing connection in our table that matches the incoming
+    // one by its original/reply tuple:
+    auto& key = connection.getKey();
+    auto old_entry = this->connections.find(key);
+    auto old_connection = old_entry ? &old_entry->connection : nullptr;
+    bool exists = (old_entry != nullptr);
+    uint32_t old_host_id = exists ? old_entry->host_id : HostInterner::NONE;
+
+    // Past the memory limit, connections we aren't tracking yet may have to
+    // be shed:
+    if (!exists && type != NFCT_T_DESTROY && !this->makeRoom(connection))
     {
-        if (this->log_events_format == "netfilter")
-            cout << connection.toNetFilterString() << endl;
-        else
-            cout << connection.toString() << endl;
+        auto state = connection.hasState() ? connection.getState() : ConnectionState::OPENING;
+        this->stats.shed_connections[static_cast<size_t>(state)]++;
+        return;
+    }
+    if (exists && this->debugging)
+    {
+        cout << "[DEBUG] Found an existing connection in the table matching the one from the current event:" << endl;
+        cout << "\t" << old_connection->toNetFilterString() << endl;
     }
 
-    // If we can find an existing connection in our table that matches the
-    // incoming one, delete it:
-    auto old_connection_it = find(this->connections.begin(), this->connections.end(), connection);
-    bool exists = (old_connection_it != this->connections.end());
+    // A connection keeps the host series it was first counted under for as
+    // long as its remote endpoint stays the same:
+    TrackedConnection new_entry;
+    new_entry.connection = connection;
     if (exists)
+        new_entry.connection.inheritCounters(*old_connection);
+    new_entry.resync_epoch = this->resync_epoch;
+    if (connection.hasTimestamps())
+        new_entry.start_time = connection.getStartTimestamp();
+    else if (exists)
+        new_entry.start_time = old_entry->start_time;
+    else if (type == NFCT_T_NEW && !this->is_rebuilding)
+        new_entry.start_time = getRealTime();
+    if (type != NFCT_T_DESTROY)
     {
-        if (this->debugging)
-        {
-            cout << "[DEBUG] Deleting an existing connection in the table matching the one from the current event:" << endl;
-            cout << "\t" << (*old_connection_it).toNetFilterString() << endl;
-        }
+        if (exists && old_connection->getRemoteEndpoint() == connection.getRemoteEndpoint())
+            this->host_ids.acquire(new_entry.host_id = old_host_id);
+        else
+            new_entry.host_id = this->host_ids.acquire(this->host_aggregator->aggregate(connection));
+    }
+
+    // Apply the state delta between the old entry and the new one to the
+    // per-host counts, leaving them alone when nothing visible changed:
+    bool same_bucket = (exists && type != NFCT_T_DESTROY &&
+                        old_connection->hasState() == connection.hasState() &&
+                        old_host_id == new_entry.host_id &&
+                        (!connection.hasState() || this->getCountedState(*old_connection) == this->getCountedState(connection)));
+    if (exists && !same_bucket)
+        this->countConnection(*old_entry, -1);
 
-        this->connections.erase(old_connection_it);
+    // Timestamps of dumped entries say nothing about when they changed state:
+    if (exists && !this->is_rebuilding)
+        this->recordTimings(type, *old_entry, connection);
+
+    // Traffic counters are folded in as deltas from the previous event. The
+    // initial dump only sets the baseline for connections that predate us:
+    if (connection.hasCounters() && (exists || !this->is_rebuilding || this->is_resyncing))
+    {
+        if (exists)
+            this->recordTraffic(old_connection, connection, old_host_id);
+        else if (type != NFCT_T_DESTROY)
+            this->recordTraffic(nullptr, connection, new_entry.host_id);
     }
 
     switch (type)
@@ -172,7 +1079,7 @@ void ConnectionTable::updateConnection(enum nf_conntrack_msg_type type, Connecti
                         cout << "[DEBUG] WARNING: Current connection was supposed to be new but it matched an existing one in our table (rebuilding="
                              << (this->is_rebuilding ? "true" : "false")
                              << "):" << endl;
-                        cout << "\t" << connection.toNetFilterString() << endl;
+                        cout << "\t" << Connection::toNetFilterString(ct, type) << endl;
                     }
                 }
                 else
@@ -182,12 +1089,14 @@ void ConnectionTable::updateConnection(enum nf_conntrack_msg_type type, Connecti
                         cout << "[DEBUG] WARNING: Tried to update an existing connection in our table but a match was not found (rebuilding="
                             << (this->is_rebuilding ? "true" : "false")
                             << "):" << endl;
-                        cout << "\t" << connection.toNetFilterString() << endl;
+                        cout << "\t" << Connection::toNetFilterString(ct, type) << endl;
                     }
                 }
             }
 
-            this->connections.push_back(connection);
+            if (!same_bucket)
+                this->countConnection(new_entry, 1);
+            this->connections.insert(key, new_entry);
 
             break;
         }
@@ -201,15 +1110,21 @@ void ConnectionTable::updateConnection(enum nf_conntrack_msg_type type, Connecti
                     cout << "[DEBUG] WARNING: Tried to delete an existing connection in our table but a match was not found (rebuilding="
                         << (this->is_rebuilding ? "true" : "false")
                         << "):" << endl;
-                    cout << "\t" << connection.toNetFilterString() << endl;
+                    cout << "\t" << Connection::toNetFilterString(ct, type) << endl;
                 }
             }
+
+            this->connections.erase(key);
             break;
         }
 
         default:
             break;
     }
+
+    // The new entry took its own reference to the host ID:
+    if (exists)
+        this->host_ids.release(old_host_id);
 }
 
 } // namespace conntrackex
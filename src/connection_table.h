@@ -1,52 +1,345 @@
 #pragma once
 
-#include <list>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <memory>
 
 #include "connection.h"
+#include "event_log.h"
+#include "event_recorder.h"
+#include "fixed_histogram.h"
+#include "flat_hash_map.h"
+#include "host_filter.h"
+#include "host_aggregator.h"
+#include "host_delta_log.h"
+#include "host_interner.h"
 
 
 namespace conntrackex {
 
 using namespace std;
 
-typedef list<Connection> ConnectionList;
+// A connection as stored in the table, along with the table's bookkeeping.
+struct TrackedConnection
+{
+    Connection connection;
+    uint32_t host_id = HostInterner::NONE; // the series this connection is counted under
+    uint32_t resync_epoch = 0; // the resync that last confirmed this entry
+
+    // When the connection started, in nanoseconds since the epoch (0 if
+    // unknown). NEW and UPDATE events carry no timestamps, so this comes
+    // from a dump or DESTROY if the kernel timestamps connections, or else
+    // from when the NEW event arrived:
+    uint64_t start_time = 0;
+};
+
+typedef FlatHashMap<ConnectionKey, TrackedConnection, ConnectionKeyHash> ConnectionMap;
+
+// How many connections to a remote host are in each state, indexed by
+// ConnectionState. The table keeps them by host ID.
+struct HostStateCounts
+{
+    uint32_t counts[4] = {};
+    uint64_t generation = 0; // table generation of the last change
+
+    uint32_t get(ConnectionState state) const { return this->counts[static_cast<size_t>(state)]; }
+    bool isEmpty() const { return !this->counts[0] && !this->counts[1] && !this->counts[2] && !this->counts[3]; }
+};
+
+// Cumulative figures for a remote host: how long its connections took to
+// open, how long they lasted, from the kernel's conntrack timestamps (needs
+// nf_conntrack_timestamp), and the traffic exchanged with it, from the
+// conntrack counters (needs nf_conntrack_acct). Unlike the state counts
+// they stay around after the host's last connection is gone, until they've
+// been idle for the table's totals expiry.
+struct HostTotals
+{
+    static const size_t DURATION_BUCKET_COUNT = 12;
+    static const size_t OPENING_BUCKET_COUNT = 12;
+    static const double DURATION_BOUNDS[DURATION_BUCKET_COUNT];
+    static const double OPENING_BOUNDS[OPENING_BUCKET_COUNT];
+
+    FixedHistogram<DURATION_BUCKET_COUNT> durations; // in seconds, on DESTROY
+    FixedHistogram<OPENING_BUCKET_COUNT> opening_times; // in seconds, from SYN to ESTABLISHED
+
+    uint64_t sent_bytes = 0;
+    uint64_t sent_packets = 0;
+    uint64_t received_bytes = 0;
+    uint64_t received_packets = 0;
+};
+
+// The table's measurements of itself. They are kept by the thread that
+// updates the table and copied into each snapshot, so none of them has to
+// be atomic.
+struct TableStats
+{
+    // Event processing latency buckets: the first one holds events that
+    // took up to 2^LATENCY_MIN_SHIFT nanoseconds, each following one twice
+    // as long, and the last one everything slower.
+    static const size_t LATENCY_BUCKET_COUNT = 14;
+    static const unsigned LATENCY_MIN_SHIFT = 8;
+    static const unsigned LATENCY_SAMPLE_INTERVAL = 16; // one in this many events is timed
+
+    uint64_t new_events = 0;
+    uint64_t update_events = 0;
+    uint64_t destroy_events = 0;
+    uint64_t ignored_events = 0;
+    uint64_t read_errors = 0;
+    uint64_t latency_buckets[LATENCY_BUCKET_COUNT + 1] = {};
+    uint64_t latency_sum_ns = 0;
+    double rebuild_seconds = 0;
+    size_t rebuild_connections = 0;
+    double snapshot_seconds = 0; // how long the previous snapshot took to build
+    size_t connection_memory_bytes = 0;
+    uint64_t shed_connections[4] = {}; // by ConnectionState, see setMemoryLimit()
+
+    static double getLatencyBucketBound(size_t bucket) { return (1ULL << (LATENCY_MIN_SHIFT + bucket)) / 1e9; }
+
+    void recordLatency(uint64_t ns)
+    {
+        size_t bucket = 0;
+        if (ns > (1ULL << LATENCY_MIN_SHIFT))
+            bucket = 64 - __builtin_clzll(ns - 1) - LATENCY_MIN_SHIFT;
+        if (bucket > LATENCY_BUCKET_COUNT)
+            bucket = LATENCY_BUCKET_COUNT;
+        this->latency_buckets[bucket]++;
+        this->latency_sum_ns += ns;
+    }
+};
+
+// An immutable copy of the per-host counts, published by the thread that
+// owns the table for readers on other threads.
+struct TableSnapshot
+{
+    struct Host
+    {
+        HostKey host;
+        shared_ptr<const string> label;
+        HostStateCounts counts;
+    };
+
+    struct Totals
+    {
+        HostKey host;
+        shared_ptr<const string> label;
+        HostTotals totals;
+    };
+
+    uint64_t generation = 0;
+    size_t connection_count = 0;
+    uint64_t overflow_count = 0;
+    uint64_t resync_count = 0;
+    uint64_t log_dropped_count = 0;
+    uint64_t log_truncated_count = 0;
+    TableStats stats;
+    vector<Host> hosts;
+
+    // Totals are shared between snapshots a page of host IDs at a time, and
+    // only the pages that changed are copied again:
+    vector<shared_ptr<const vector<Totals>>> host_totals;
+};
 
 class ConnectionTable
 {
 public:
 
-    ConnectionTable();
+    // Which conntrack events to subscribe to. Most events of a busy table
+    // are UPDATEs for state changes that don't move a connection between
+    // the exported states, so the reduced modes trade some accuracy for
+    // far fewer events:
+    enum class EventGroups
+    {
+        ALL,
+        NEW_DESTROY, // connections count as open from NEW until DESTROY
+        TRANSITIONS  // only UPDATEs entering a state that starts an exported one
+    };
+
     ~ConnectionTable();
 
-    void enableLogging(bool enable = true) { this->log_events = enable; }
+    void setEventLog(EventLog* event_log) { this->event_log = event_log; }
+    void setEventRecorder(EventRecorder* event_recorder) { this->event_recorder = event_recorder; }
     void enableDebugging(bool enable = true) { this->debugging = enable; }
-    void setLoggingFormat(string format) { this->log_events_format = format; }
-    void addIgnoredHost(const string& host) { this->ignored_hosts.push_back(host); }
+    void addIgnoredHost(const string& host) { this->ignored_hosts.add(IgnoreRule::parse(host)); }
+    void setReceiveBufferSize(int bytes) { this->receive_buffer_size = bytes; }
+    void setEventGroups(EventGroups event_groups) { this->event_groups = event_groups; }
+    void setEventGroups(const string& event_groups);
+
+    // Reconcile the table against a dump this often, to catch whatever the
+    // reduced event groups miss (0 disables):
+    void setResyncInterval(unsigned seconds) { this->resync_interval = seconds; }
+
+    // Drop the totals of hosts that have had no connections and nothing to
+    // add to their totals for at least this long (0 keeps them for good):
+    void setHostTotalsExpiry(unsigned seconds) { this->host_totals_expiry = seconds; }
+
+    // Drops the totals that have been idle for a whole expiry interval. An
+    // attached table calls this on a timer; one fed through processEvent()
+    // has to be told when an interval is up:
+    void expireHostTotals();
+
+    // Bounds the memory used to store connections, growth included. Once
+    // the table is full, connections still opening (as in a SYN flood) are
+    // shed first: new ones aren't tracked, and room for any other new
+    // connection is made by evicting one. Shed connections are counted by
+    // state and left out of the per-host counts.
+    void setMemoryLimit(size_t bytes);
+
+    // Keep a log of the last `capacity` per-host count changes, published
+    // by publishDeltas() and along with each snapshot:
+    void enableDeltaLog(size_t capacity) { this->delta_log.reset(new HostDeltaLog(capacity)); }
+    const HostDeltaLog* getDeltaLog() const { return this->delta_log.get(); }
+
+    // Watch the connections of another network namespace; the fd must stay
+    // open for as long as the table does:
+    void setNetworkNamespace(int namespace_fd);
+
+    // Remote hosts are exported one series per endpoint unless an aggregator
+    // is set. Tables share one so that the top hosts are picked across them:
+    void setHostAggregator(HostAggregator* host_aggregator) { this->host_aggregator = host_aggregator; }
 
+    // Opens the conntrack sockets and loads the current table. A table that
+    // was never attached can still be fed events through processEvent():
     void attach();
-    void update();
 
-    const ConnectionList& getConnections() const { return this->connections; }
+    // Applies one conntrack event as if it had arrived on the event socket:
+    void processEvent(enum nf_conntrack_msg_type type, const nf_conntrack* ct);
+
+    // Dumps go through these, live or replayed. A dump either rebuilds the
+    // table from scratch or, as a resync, reconciles it with the kernel's;
+    // an incomplete resync removes nothing:
+    void beginDump(bool resync);
+    void processDumpEntry(const nf_conntrack* ct);
+    void endDump(bool complete);
+
+    // Swaps in another set of local addresses, as a recording says they
+    // changed, and moves the affected connections between hosts:
+    void replaceLocalAddresses(const vector<uint32_t>& ipv4_addresses, const vector<IPv6Address>& ipv6_addresses);
+
+    // Resyncs run in the background: the dump is requested on a separate
+    // socket and drained by updateResync() alongside the live events.
+    void startResync();
+    void updateResync();
+    bool isResyncing() const { return this->is_resyncing; }
+
+    LocalAddressSet& getLocalAddresses() { return this->local_addresses; }
+
+    // The ignore rules the kernel filters are given. The kernel matches
+    // them against the original tuple, which agrees with the remote
+    // endpoint only if that tuple names a local address. So there are none
+    // until a full dump has shown no NATed or forwarded connections, and
+    // none for good once such a connection turns up.
+    vector<IgnoreRule> getKernelRules() const;
+    const ConnectionMap& getConnections() const { return this->connections; }
+    size_t getHostCount() const { return this->host_count; }
+
+    // The sockets the table needs to hear from, and what to call when one of
+    // them becomes readable:
+    vector<int> getFileDescriptors();
+    void handleEvents(int fd);
+
+    // Snapshots are built by the thread that updates the table, and only
+    // when a reader asks for one: requestSnapshot() wakes that thread up
+    // through one of the table's file descriptors, and waitForSnapshot()
+    // returns once it has published the table as of the request (or the
+    // timeout is up). A table that isn't attached is never waited for. Any
+    // thread may read the latest snapshot without locking the table itself.
+    bool hasUnpublishedChanges() const { return this->generation != this->published_generation; }
+    void publishSnapshot();
+    uint64_t requestSnapshot() const;
+    shared_ptr<const TableSnapshot> waitForSnapshot(uint64_t request, chrono::milliseconds timeout) const;
+    shared_ptr<const TableSnapshot> getSnapshot() const { return atomic_load(&this->snapshot); }
+
+    // Per-host changes are logged much more cheaply than snapshots are
+    // built, so they're published on a timer of their own:
+    bool hasUnpublishedDeltas() const { return !this->changed_host_ids.empty(); }
+    void publishDeltas();
 
 private:
 
-    nfct_handle* makeConntrackHandle();
+    static nfct_handle* makeConntrackHandle(unsigned groups);
+    static size_t getKernelConnectionCount();
+    static int makeTimer(unsigned seconds);
+    void attachFilters();
+    void attachFilter(nfct_handle* handle, bool filter_states = false);
+    void setNonBlocking(nfct_handle* handle);
+    void update(nfct_handle* handle);
     void rebuild();
-    void updateConnection(enum nf_conntrack_msg_type type, Connection& connection);
-    bool isIgnoredHost(const string& host) const;
-
-    static int nfct_callback_attach(enum nf_conntrack_msg_type type, struct nf_conntrack* ct, void* data);
-    static int nfct_callback_rebuild(enum nf_conntrack_msg_type type, struct nf_conntrack* ct, void* data);
-    static int nfct_callback_dummy(enum nf_conntrack_msg_type type, struct nf_conntrack* ct, void* data) { return NFCT_CB_STOP; }
-
-    nfct_handle* attach_handle;
-    nfct_handle* rebuild_handle;
-    bool is_rebuilding;
-    bool log_events = false;
-    string log_events_format = "netfilter";
+    void checkRecorder() const;
+    void finishResync();
+    void updateLocalAddresses();
+    void reclassifyConnections(bool all, const vector<uint32_t>& changed_addresses);
+    void updateConnection(enum nf_conntrack_msg_type type, Connection& connection, const nf_conntrack* ct);
+    void withdrawKernelRules();
+    bool isIgnoredHost(const Endpoint& host) const { return this->ignored_hosts.matches(host); }
+    void countConnection(const TrackedConnection& entry, int delta);
+    bool makeRoom(const Connection& connection);
+    void markHostChanged(uint32_t host_id);
+    void serveSnapshotRequests();
+    void removeConnection(const ConnectionKey& key);
+    ConnectionState getCountedState(const Connection& connection) const;
+    void recordTimings(enum nf_conntrack_msg_type type, const TrackedConnection& old_entry, const Connection& connection);
+    void recordTraffic(const Connection* old_connection, const Connection& connection, uint32_t host_id);
+    HostTotals& getHostTotals(uint32_t host_id);
+    void markTotalsChanged(uint32_t host_id);
+
+    static int nfct_callback_attach(const struct nlmsghdr* message, enum nf_conntrack_msg_type type, struct nf_conntrack* ct, void* data);
+    static int nfct_callback_rebuild(const struct nlmsghdr* message, enum nf_conntrack_msg_type type, struct nf_conntrack* ct, void* data);
+
+    nfct_handle* attach_handle = nullptr;
+    nfct_handle* destroy_handle = nullptr; // DESTROY events, in TRANSITIONS mode
+    nfct_handle* rebuild_handle = nullptr;
+    int resync_timer_fd = -1;
+    int totals_timer_fd = -1;
+    atomic<int> snapshot_request_fd{-1}; // set by attach() while readers may be asking
+    EventGroups event_groups = EventGroups::ALL;
+    unsigned resync_interval = 0;
+    unsigned host_totals_expiry = 300;
+    bool is_rebuilding = false;
+    bool is_resyncing = false;
+    uint32_t resync_epoch = 0;
+    chrono::steady_clock::time_point rebuild_started_at;
+    int receive_buffer_size = 0;
+    size_t kernel_rule_count = 0; // ignore rules in the kernel socket filters
+    bool is_table_loaded = false; // the first full dump is done
+    bool has_translated_connections = false;
+    bool is_resync_pending = false; // start another resync once this one ends
+    int namespace_fd = -1;
+    uint64_t overflow_count = 0;
+    uint64_t resync_count = 0;
+    TableStats stats;
+    uint64_t event_count = 0;
+    EventLog* event_log = nullptr;
+    EventRecorder* event_recorder = nullptr;
     bool debugging = false;
-    ConnectionList connections;
-    list<string> ignored_hosts;
+    LocalAddressSet local_addresses;
+    ConnectionMap connections;
+    size_t max_connections = SIZE_MAX;
+    size_t eviction_cursor = 0;
+    HostInterner host_ids;
+    vector<HostStateCounts> host_counts; // by host ID
+    size_t host_count = 0;               // hosts with any connections
+    vector<HostTotals> host_totals;      // by host ID
+    vector<bool> has_host_totals;        // by host ID; such IDs are held until the totals expire
+    vector<uint32_t> host_totals_epoch;  // by host ID: the expiry interval they last changed in
+    uint32_t totals_epoch = 0;
+    vector<shared_ptr<const vector<TableSnapshot::Totals>>> totals_pages;
+    vector<bool> is_totals_page_changed;
+    unique_ptr<HostDeltaLog> delta_log;
+    vector<uint32_t> changed_host_ids;   // held on to until they're published
+    vector<bool> is_host_changed;        // by host ID
+    uint64_t generation = 0;
+    uint64_t published_generation = 0;
+    shared_ptr<const TableSnapshot> snapshot = make_shared<TableSnapshot>();
+    mutable atomic<uint64_t> snapshot_requests{0};
+    mutable mutex served_snapshots_mutex;
+    mutable condition_variable snapshot_served;
+    uint64_t served_snapshots = 0;
+    HostFilter ignored_hosts;
+    HostAggregator default_host_aggregator;
+    HostAggregator* host_aggregator = &this->default_host_aggregator;
 };
 
 } // namespace conntrackex
@@ -0,0 +1,313 @@
+#include "event_log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <stdexcept>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+const size_t EventLog::SLOT_COUNT;
+const size_t EventLog::LINE_SIZE;
+
+namespace {
+
+// Once woken up by a new event, the writer waits this long for more before
+// writing, so events are written in batches instead of one syscall each.
+const chrono::milliseconds BATCH_DELAY(10);
+
+// How long to keep writing to the old file after a rotation failed before
+// trying again:
+const chrono::seconds ROTATION_RETRY_INTERVAL(10);
+
+const size_t BATCH_SIZE = 64 * 1024;
+const size_t DATAGRAM_BATCH_SIZE = 64;
+
+} // namespace
+
+EventLog::EventLog() : slots(new Slot[SLOT_COUNT])
+{
+    this->batch.reserve(BATCH_SIZE + LINE_SIZE);
+}
+
+EventLog::~EventLog()
+{
+    this->stop();
+    if (this->fd > STDERR_FILENO)
+        close(this->fd);
+    if (this->wakeup_fd >= 0)
+        close(this->wakeup_fd);
+}
+
+void EventLog::setFormat(const string& format)
+{
+    this->format = (format == "netfilter") ? Format::NETFILTER : Format::JSON;
+}
+
+void EventLog::setFile(const string& path, size_t max_file_size)
+{
+    this->file_path = path;
+    this->max_file_size = max_file_size;
+}
+
+void EventLog::setSocket(const string& path)
+{
+    this->socket_path = path;
+}
+
+void EventLog::start()
+{
+    if (!this->socket_path.empty())
+    {
+        this->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        if (this->fd < 0)
+            throw runtime_error("Unable to create the event log socket.");
+
+        struct sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (this->socket_path.size() >= sizeof(address.sun_path))
+            throw runtime_error("Event log socket path is too long.");
+        strncpy(address.sun_path, this->socket_path.c_str(), sizeof(address.sun_path) - 1);
+        if (connect(this->fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+            throw runtime_error("Unable to connect to the event log socket '" + this->socket_path + "'.");
+    }
+    else if (!this->file_path.empty())
+    {
+        if (!this->openFile())
+            throw runtime_error("Unable to open the event log file '" + this->file_path + "'.");
+    }
+    else
+        this->fd = STDOUT_FILENO;
+
+    this->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (this->wakeup_fd < 0)
+        throw runtime_error("Unable to create the event log's wakeup eventfd.");
+
+    this->running = true;
+    this->writer = thread(&EventLog::run, this);
+}
+
+void EventLog::stop()
+{
+    if (!this->running.exchange(false))
+        return;
+
+    this->wake();
+    this->writer.join();
+}
+
+void EventLog::push(const Connection& connection, const nf_conntrack* ct, nf_conntrack_msg_type type)
+{
+    if (!this->multiple_producers)
+    {
+        this->append(connection, ct, type);
+        return;
+    }
+
+    lock_guard<mutex> lock(this->producers_mutex);
+    this->append(connection, ct, type);
+}
+
+void EventLog::append(const Connection& connection, const nf_conntrack* ct, nf_conntrack_msg_type type)
+{
+    size_t head = this->head.load(memory_order_relaxed);
+    if (head - this->tail.load(memory_order_acquire) >= SLOT_COUNT)
+    {
+        this->dropped_count.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+
+    // Lines are formatted straight into the slot; the terminating null the
+    // formatters leave room for becomes the newline:
+    auto& slot = this->slots[head & (SLOT_COUNT - 1)];
+    size_t length = (this->format == Format::NETFILTER) ?
+        Connection::formatNetFilter(slot.line, sizeof(slot.line), ct, type) :
+        connection.formatJSON(slot.line, sizeof(slot.line));
+    slot.line[length] = '\n';
+    slot.length = static_cast<uint16_t>(length + 1);
+
+    // The formatters only fill the slot up to the terminating null when
+    // they had to cut the line short:
+    if (length + 1 >= sizeof(slot.line))
+        this->truncated_count.fetch_add(1, memory_order_relaxed);
+
+    this->head.store(head + 1, memory_order_release);
+
+    // Pairs with the fence in wait(): either the writer sees this event
+    // before it goes to sleep, or this sees the writer asleep and wakes it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (this->is_writer_idle.load(memory_order_relaxed) && this->is_writer_idle.exchange(false))
+        this->wake();
+}
+
+void EventLog::run()
+{
+    while (this->running)
+    {
+        this->drain();
+        this->wait();
+
+        // Give more events a moment to arrive, so they're written together:
+        if (this->running)
+            this_thread::sleep_for(BATCH_DELAY);
+    }
+
+    // Write out whatever was logged before stopping:
+    this->drain();
+}
+
+void EventLog::wait()
+{
+    this->is_writer_idle.store(true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (this->head.load(memory_order_relaxed) == this->tail.load(memory_order_relaxed) && this->running)
+    {
+        uint64_t count;
+        while (read(this->wakeup_fd, &count, sizeof(count)) < 0 && errno == EINTR)
+            continue;
+    }
+
+    // A producer may have cleared it already and signalled the eventfd; that
+    // just makes the next wait return right away:
+    this->is_writer_idle.store(false, memory_order_relaxed);
+}
+
+void EventLog::wake()
+{
+    uint64_t count = 1;
+    while (write(this->wakeup_fd, &count, sizeof(count)) < 0 && errno == EINTR)
+        continue;
+}
+
+void EventLog::drain()
+{
+    size_t tail = this->tail.load(memory_order_relaxed);
+    size_t head = this->head.load(memory_order_acquire);
+
+    if (!this->socket_path.empty())
+    {
+        // One datagram per event, handed to the kernel in batches:
+        struct mmsghdr messages[DATAGRAM_BATCH_SIZE];
+        struct iovec vectors[DATAGRAM_BATCH_SIZE];
+        while (tail != head)
+        {
+            unsigned count = 0;
+            for (; count < DATAGRAM_BATCH_SIZE && tail + count != head; count++)
+            {
+                auto& slot = this->slots[(tail + count) & (SLOT_COUNT - 1)];
+                vectors[count].iov_base = slot.line;
+                vectors[count].iov_len = slot.length - 1; // no newline in datagrams
+                messages[count] = {};
+                messages[count].msg_hdr.msg_iov = &vectors[count];
+                messages[count].msg_hdr.msg_iovlen = 1;
+            }
+
+            int sent = sendmmsg(this->fd, messages, count, 0);
+            if (sent < static_cast<int>(count))
+                this->dropped_count.fetch_add(count - max(sent, 0), memory_order_relaxed);
+
+            tail += count;
+            this->tail.store(tail, memory_order_release);
+        }
+        return;
+    }
+
+    while (tail != head)
+    {
+        auto& slot = this->slots[tail & (SLOT_COUNT - 1)];
+        this->batch.append(slot.line, slot.length);
+        this->tail.store(++tail, memory_order_release);
+
+        if (this->batch.size() >= BATCH_SIZE)
+            this->flush();
+    }
+    this->flush();
+}
+
+void EventLog::flush()
+{
+    size_t written = 0;
+    while (written < this->batch.size())
+    {
+        auto result = write(this->fd, this->batch.data() + written, this->batch.size() - written);
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            // Warn once, not for every batch, until writing works again:
+            if (!this->is_write_failing)
+                cerr << "[WARNING] Unable to write the event log: " << strerror(errno) << endl;
+            this->is_write_failing = true;
+            break;
+        }
+        written += result;
+    }
+
+    if (!this->batch.empty() && written == this->batch.size())
+        this->is_write_failing = false;
+
+    this->file_size += written;
+    this->batch.clear();
+
+    if (this->max_file_size && this->file_size >= this->max_file_size)
+        this->rotateFile();
+}
+
+bool EventLog::openFile()
+{
+    int file_fd = open(this->file_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (file_fd < 0)
+        return false;
+
+    this->fd = file_fd;
+    struct stat file_stat;
+    this->file_size = (fstat(this->fd, &file_stat) == 0) ? file_stat.st_size : 0;
+    return true;
+}
+
+void EventLog::rotateFile()
+{
+    auto now = chrono::steady_clock::now();
+    if (now < this->next_rotation_time)
+        return;
+
+    // The old descriptor keeps writing to the renamed file until a new one
+    // could be opened, so a failure here loses nothing:
+    if (!this->is_reopen_pending)
+    {
+        string rotated_path = this->file_path + ".1";
+        if (rename(this->file_path.c_str(), rotated_path.c_str()) != 0)
+        {
+            cerr << "[WARNING] Unable to rotate the event log file: " << strerror(errno) << endl;
+            this->next_rotation_time = now + ROTATION_RETRY_INTERVAL;
+            return;
+        }
+        this->is_reopen_pending = true;
+    }
+
+    int rotated_fd = this->fd;
+    if (!this->openFile())
+    {
+        cerr << "[WARNING] Unable to reopen the event log file '" << this->file_path << "': " << strerror(errno) << endl;
+        this->next_rotation_time = now + ROTATION_RETRY_INTERVAL;
+        return;
+    }
+
+    close(rotated_fd);
+    this->is_reopen_pending = false;
+}
+
+} // namespace conntrackex
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "connection.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// Writes connection event logs from a background thread so logging never
+// blocks event ingestion. Events are formatted into a fixed-size slot of a
+// single-producer/single-consumer ring (several producers take turns); the
+// writer sleeps until events arrive and then drains the ring in large
+// batches. When the ring is full, events are dropped and counted.
+class EventLog
+{
+public:
+
+    enum class Format
+    {
+        NETFILTER,
+        JSON
+    };
+
+    EventLog();
+    ~EventLog();
+
+    void setFormat(Format format) { this->format = format; }
+    void setFormat(const string& format);
+
+    // Where to write to (stdout by default). Files are rotated to "<path>.1"
+    // once they grow past max_file_size bytes (0 disables rotation); sockets
+    // get one datagram per event.
+    void setFile(const string& path, size_t max_file_size);
+    void setSocket(const string& path);
+
+    // Needed when tables on several ingestion threads log to this one:
+    void setMultipleProducers(bool multiple_producers) { this->multiple_producers = multiple_producers; }
+
+    void start();
+    void stop();
+
+    // Called from the ingestion thread only, unless there are multiple
+    // producers:
+    void push(const Connection& connection, const nf_conntrack* ct, nf_conntrack_msg_type type);
+
+    uint64_t getDroppedCount() const { return this->dropped_count.load(memory_order_relaxed); }
+
+    // Lines longer than a slot are cut short; this counts them:
+    uint64_t getTruncatedCount() const { return this->truncated_count.load(memory_order_relaxed); }
+
+private:
+
+    static const size_t SLOT_COUNT = 8192; // must be a power of two
+    static const size_t LINE_SIZE = 512;
+
+    struct Slot
+    {
+        uint16_t length;
+        char line[LINE_SIZE - sizeof(uint16_t)];
+    };
+
+    void append(const Connection& connection, const nf_conntrack* ct, nf_conntrack_msg_type type);
+    void run();
+    void wait();
+    void wake();
+    void drain();
+    void flush();
+    bool openFile();
+    void rotateFile();
+
+    Format format = Format::NETFILTER;
+    string file_path;
+    size_t max_file_size = 0;
+    size_t file_size = 0;
+    string socket_path;
+    int fd = -1;
+
+    // After a failed rotation the old file is kept and the rotation is
+    // retried later; is_reopen_pending is set once it has been renamed:
+    chrono::steady_clock::time_point next_rotation_time;
+    bool is_reopen_pending = false;
+    bool is_write_failing = false;
+
+    unique_ptr<Slot[]> slots;
+    atomic<size_t> head{0}; // next slot the producer writes
+    atomic<size_t> tail{0}; // next slot the writer reads
+    atomic<uint64_t> dropped_count{0};
+    atomic<uint64_t> truncated_count{0};
+    bool multiple_producers = false;
+    mutex producers_mutex;
+
+    string batch;
+    thread writer;
+    atomic<bool> running{false};
+
+    // The writer blocks on wakeup_fd (an eventfd) while the ring is empty;
+    // producers only signal it when is_writer_idle is set:
+    int wakeup_fd = -1;
+    atomic<bool> is_writer_idle{false};
+};
+
+} // namespace conntrackex
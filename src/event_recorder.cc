@@ -0,0 +1,224 @@
+#include "event_recorder.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include "connection_table.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+namespace {
+
+const char MAGIC[8] = {'C', 'T', 'E', 'X', 'R', 'E', 'C', '2'};
+
+enum RecordType : uint32_t
+{
+    EVENT = 0,
+    DUMP_START = 1,
+    DUMP_ENTRY = 2,
+    DUMP_END = 3,
+    ADDRESSES = 4
+};
+
+// No conntrack message comes anywhere near this, and no host has this many
+// addresses; anything bigger means the file is corrupt:
+const uint32_t MAX_RECORD_LENGTH = 1 << 20;
+
+} // namespace
+
+EventRecorder::~EventRecorder()
+{
+    if (this->file)
+        fclose(this->file);
+}
+
+void EventRecorder::open(const string& path)
+{
+    this->file = fopen(path.c_str(), "wb");
+    if (!this->file)
+        throw runtime_error("Unable to open the event recording file '" + path + "'.");
+
+    // Writes are batched by stdio; a big buffer keeps syscalls rare during
+    // event storms:
+    setvbuf(this->file, nullptr, _IOFBF, 1 << 20);
+}
+
+void EventRecorder::writeHeader(const LocalAddressSet& local_addresses)
+{
+    fwrite(MAGIC, sizeof(MAGIC), 1, this->file);
+    this->start = chrono::steady_clock::now();
+    this->recordAddresses(local_addresses);
+}
+
+void EventRecorder::recordEvent(const struct nlmsghdr* message)
+{
+    this->write(EVENT, message, message->nlmsg_len);
+}
+
+void EventRecorder::recordDumpStart(bool resync)
+{
+    uint32_t payload = resync ? 1 : 0;
+    this->write(DUMP_START, &payload, sizeof(payload));
+}
+
+void EventRecorder::recordDumpEntry(const struct nlmsghdr* message)
+{
+    this->write(DUMP_ENTRY, message, message->nlmsg_len);
+}
+
+void EventRecorder::recordDumpEnd(bool complete)
+{
+    uint32_t payload = complete ? 1 : 0;
+    this->write(DUMP_END, &payload, sizeof(payload));
+}
+
+void EventRecorder::recordAddresses(const LocalAddressSet& local_addresses)
+{
+    vector<uint8_t> payload(2 * sizeof(uint32_t));
+    uint32_t counts[2] = {
+        static_cast<uint32_t>(local_addresses.getIPv4Addresses().size()),
+        static_cast<uint32_t>(local_addresses.getIPv6Addresses().size())
+    };
+    memcpy(payload.data(), counts, sizeof(counts));
+
+    for (auto& entry : local_addresses.getIPv4Addresses())
+    {
+        auto bytes = reinterpret_cast<const uint8_t*>(&entry.key);
+        payload.insert(payload.end(), bytes, bytes + sizeof(entry.key));
+    }
+    for (auto& entry : local_addresses.getIPv6Addresses())
+        payload.insert(payload.end(), entry.key.bytes, entry.key.bytes + sizeof(entry.key.bytes));
+
+    this->write(ADDRESSES, payload.data(), payload.size());
+}
+
+void EventRecorder::write(uint32_t type, const void* payload, uint32_t length)
+{
+    if (this->hasFailed())
+        return;
+
+    uint64_t timestamp = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - this->start).count();
+
+    fwrite(&timestamp, sizeof(timestamp), 1, this->file);
+    fwrite(&type, sizeof(type), 1, this->file);
+    fwrite(&length, sizeof(length), 1, this->file);
+    if (fwrite(payload, length, 1, this->file) != 1)
+        this->error = string("Unable to write to the event recording file: ") + strerror(errno);
+}
+
+EventReplayer::~EventReplayer()
+{
+    if (this->file)
+        fclose(this->file);
+}
+
+void EventReplayer::open(const string& path)
+{
+    this->file = fopen(path.c_str(), "rb");
+    if (!this->file)
+        throw runtime_error("Unable to open the event recording file '" + path + "'.");
+
+    char magic[sizeof(MAGIC)];
+    if (fread(magic, sizeof(magic), 1, this->file) != 1 || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+        throw runtime_error("'" + path + "' is not an event recording, or was made by an older version.");
+}
+
+bool EventReplayer::replayNext(ConnectionTable& table)
+{
+    uint64_t timestamp;
+    uint32_t type;
+    uint32_t length;
+    if (fread(&timestamp, sizeof(timestamp), 1, this->file) != 1 ||
+        fread(&type, sizeof(type), 1, this->file) != 1 ||
+        fread(&length, sizeof(length), 1, this->file) != 1)
+        return false;
+
+    if (length > MAX_RECORD_LENGTH)
+        throw runtime_error("Event recording is corrupt.");
+
+    this->buffer.resize((length + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    if (length > 0 && fread(this->buffer.data(), length, 1, this->file) != 1)
+        return false; // the recording was cut off mid-record
+
+    if (this->original_pacing)
+    {
+        if (!this->started)
+            this->start = chrono::steady_clock::now() - chrono::nanoseconds(timestamp);
+        this_thread::sleep_until(this->start + chrono::nanoseconds(timestamp));
+    }
+    this->started = true;
+
+    uint32_t flag = 0;
+    if ((type == DUMP_START || type == DUMP_END) && length >= sizeof(flag))
+        memcpy(&flag, this->buffer.data(), sizeof(flag));
+
+    switch (type)
+    {
+        case EVENT:
+        case DUMP_ENTRY:
+            if (length < sizeof(struct nlmsghdr))
+                throw runtime_error("Event recording is corrupt.");
+            this->replayMessage(table, type == DUMP_ENTRY);
+            this->event_count++;
+            break;
+        case DUMP_START:
+            table.beginDump(flag != 0);
+            break;
+        case DUMP_END:
+            table.endDump(flag != 0);
+            break;
+        case ADDRESSES:
+            this->replayAddresses(table, length);
+            break;
+        default:
+            throw runtime_error("Event recording is corrupt.");
+    }
+    return true;
+}
+
+void EventReplayer::replayMessage(ConnectionTable& table, bool dump_entry) const
+{
+    // This is what libnetfilter_conntrack does with each message it reads
+    // off the socket before calling back into the table:
+    auto ct = nfct_new();
+    if (!ct)
+        throw runtime_error("Unable to allocate a conntrack object.");
+    auto message = reinterpret_cast<const struct nlmsghdr*>(this->buffer.data());
+    int type = nfct_parse_conntrack(NFCT_T_ALL, message, ct);
+    if (type > 0)
+    {
+        if (dump_entry)
+            table.processDumpEntry(ct);
+        else
+            table.processEvent(static_cast<nf_conntrack_msg_type>(type), ct);
+    }
+    nfct_destroy(ct);
+}
+
+void EventReplayer::replayAddresses(ConnectionTable& table, uint32_t length) const
+{
+    auto bytes = reinterpret_cast<const uint8_t*>(this->buffer.data());
+    uint32_t counts[2];
+    if (length < sizeof(counts))
+        throw runtime_error("Event recording is corrupt.");
+    memcpy(counts, bytes, sizeof(counts));
+    if (length != sizeof(counts) + counts[0] * sizeof(uint32_t) + counts[1] * sizeof(IPv6Address::bytes))
+        throw runtime_error("Event recording is corrupt.");
+
+    vector<uint32_t> ipv4_addresses(counts[0]);
+    memcpy(ipv4_addresses.data(), bytes + sizeof(counts), counts[0] * sizeof(uint32_t));
+
+    vector<IPv6Address> ipv6_addresses(counts[1]);
+    auto ipv6_bytes = bytes + sizeof(counts) + counts[0] * sizeof(uint32_t);
+    for (uint32_t i = 0; i < counts[1]; i++)
+        memcpy(ipv6_addresses[i].bytes, ipv6_bytes + i * sizeof(IPv6Address::bytes), sizeof(IPv6Address::bytes));
+
+    table.replaceLocalAddresses(ipv4_addresses, ipv6_addresses);
+}
+
+} // namespace conntrackex
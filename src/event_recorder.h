@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <linux/netlink.h>
+
+#include "local_addresses.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+class ConnectionTable;
+
+// Recordings are append-only files of what the exporter's table was fed:
+// the raw conntrack netlink messages it received, the dumps it was built and
+// resynced from with where each starts and ends, and the local addresses,
+// which decide which end of a connection is remote, whenever they change.
+// Each record has the nanoseconds elapsed since recording started. All
+// integers are in host byte order except the addresses:
+//
+//     header: "CTEXREC2"
+//     record: uint64 timestamp | uint32 type | uint32 length | payload
+//
+//     event, dump entry: a netlink message
+//     dump start: uint32 1 for a resync, 0 for a rebuild
+//     dump end: uint32 1 if the dump completed, 0 if it was cut short
+//     addresses: uint32 IPv4 count | uint32 IPv6 count | IPv4 addresses | IPv6 addresses
+//
+// Recordings are meant to be replayed on the machine (or at least the
+// architecture) they were made on.
+class EventRecorder
+{
+public:
+
+    ~EventRecorder();
+
+    void open(const string& path);
+    void writeHeader(const LocalAddressSet& local_addresses);
+    void recordEvent(const struct nlmsghdr* message);
+    void recordDumpStart(bool resync);
+    void recordDumpEntry(const struct nlmsghdr* message);
+    void recordDumpEnd(bool complete);
+    void recordAddresses(const LocalAddressSet& local_addresses);
+
+    // Records are made from netlink callbacks, which mustn't throw. The
+    // first write error is kept here instead, and nothing more is recorded:
+    bool hasFailed() const { return !this->error.empty(); }
+    const string& getError() const { return this->error; }
+
+private:
+
+    void write(uint32_t type, const void* payload, uint32_t length);
+
+    FILE* file = nullptr;
+    chrono::steady_clock::time_point start;
+    string error;
+};
+
+// Feeds a recording through the same parsing and table update paths as live
+// events, dumps and address changes, either as fast as possible or at the
+// pace it was recorded at.
+class EventReplayer
+{
+public:
+
+    ~EventReplayer();
+
+    void open(const string& path);
+    void setOriginalPacing(bool enable = true) { this->original_pacing = enable; }
+
+    // Replays the next record; returns false at the end of the file:
+    bool replayNext(ConnectionTable& table);
+
+    // Conntrack messages replayed so far, events and dump entries alike:
+    uint64_t getEventCount() const { return this->event_count; }
+
+private:
+
+    void replayMessage(ConnectionTable& table, bool dump_entry) const;
+    void replayAddresses(ConnectionTable& table, uint32_t length) const;
+
+    FILE* file = nullptr;
+    bool original_pacing = false;
+    bool started = false;
+    chrono::steady_clock::time_point start;
+    vector<uint64_t> buffer; // 64-bit elements keep messages aligned
+    uint64_t event_count = 0;
+};
+
+} // namespace conntrackex
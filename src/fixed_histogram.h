@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// A cumulative histogram over N fixed bucket bounds. It only holds a count
+// per bucket and a running sum, so it is cheap enough to keep one per host.
+template <size_t N>
+struct FixedHistogram
+{
+    uint64_t counts[N + 1] = {}; // the last one counts values above every bound
+    double sum = 0;
+
+    void observe(const double (&bounds)[N], double value)
+    {
+        size_t bucket = 0;
+        while (bucket < N && value > bounds[bucket])
+            bucket++;
+        this->counts[bucket]++;
+        this->sum += value;
+    }
+
+    uint64_t getCount() const
+    {
+        uint64_t count = 0;
+        for (auto bucket_count : this->counts)
+            count += bucket_count;
+        return count;
+    }
+};
+
+} // namespace conntrackex
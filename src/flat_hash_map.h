@@ -0,0 +1,203 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// An open-addressing hash map with linear probing. Entries live inline in a
+// single contiguous array and deletions use backward-shift, so there are no
+// tombstones and lookups stay short no matter how much churn the table sees.
+template <class Key, class Value, class Hash>
+class FlatHashMap
+{
+public:
+
+    struct Entry
+    {
+        Key key;
+        Value value;
+    };
+
+private:
+
+    struct Slot
+    {
+        Entry entry;
+        bool used = false;
+    };
+
+public:
+
+    template <class SlotT, class EntryT>
+    class Iterator
+    {
+    public:
+
+        Iterator(SlotT* slot, SlotT* end) : slot(slot), end(end) { this->skipUnused(); }
+
+        EntryT& operator*() const { return this->slot->entry; }
+        EntryT* operator->() const { return &this->slot->entry; }
+        Iterator& operator++() { ++this->slot; this->skipUnused(); return *this; }
+        bool operator==(const Iterator& other) const { return this->slot == other.slot; }
+        bool operator!=(const Iterator& other) const { return this->slot != other.slot; }
+
+    private:
+
+        void skipUnused() { while (this->slot != this->end && !this->slot->used) ++this->slot; }
+
+        SlotT* slot;
+        SlotT* end;
+    };
+
+    typedef Iterator<Slot, Entry> iterator;
+    typedef Iterator<const Slot, const Entry> const_iterator;
+
+    FlatHashMap() { this->slots.resize(MIN_CAPACITY); }
+
+    size_t size() const { return this->count; }
+    bool empty() const { return this->count == 0; }
+    size_t capacity() const { return this->slots.size(); }
+
+    // What each slot of the capacity costs, and how many entries fit in a
+    // capacity before it has to grow:
+    static size_t getSlotSize() { return sizeof(Slot); }
+    static size_t getMaxSize(size_t capacity) { return capacity * MAX_LOAD_NUMERATOR / MAX_LOAD_DENOMINATOR; }
+    static size_t getMinCapacity() { return MIN_CAPACITY; }
+
+    // The entry in a slot, if it's in use, for walking the map from an
+    // arbitrary position (any index below capacity()):
+    Entry* getEntryAt(size_t index) { return this->slots[index].used ? &this->slots[index].entry : nullptr; }
+
+    iterator begin() { return iterator(this->slots.data(), this->slots.data() + this->slots.size()); }
+    iterator end() { return iterator(this->slots.data() + this->slots.size(), this->slots.data() + this->slots.size()); }
+    const_iterator begin() const { return const_iterator(this->slots.data(), this->slots.data() + this->slots.size()); }
+    const_iterator end() const { return const_iterator(this->slots.data() + this->slots.size(), this->slots.data() + this->slots.size()); }
+
+    void clear()
+    {
+        for (auto& slot : this->slots)
+            slot = Slot();
+        this->count = 0;
+    }
+
+    // Makes room for at least the given number of entries without rehashing:
+    void reserve(size_t entries)
+    {
+        size_t wanted = MIN_CAPACITY;
+        while (wanted * MAX_LOAD_NUMERATOR < entries * MAX_LOAD_DENOMINATOR)
+            wanted *= 2;
+        if (wanted > this->slots.size())
+            this->rehash(wanted);
+    }
+
+    Value* find(const Key& key)
+    {
+        size_t index;
+        return this->locate(key, index) ? &this->slots[index].entry.value : nullptr;
+    }
+
+    const Value* find(const Key& key) const
+    {
+        size_t index;
+        return this->locate(key, index) ? &this->slots[index].entry.value : nullptr;
+    }
+
+    // Inserts the value, replacing any existing one stored under the same key:
+    Value& insert(const Key& key, Value value)
+    {
+        size_t index;
+        if (this->locate(key, index))
+        {
+            this->slots[index].entry.value = move(value);
+            return this->slots[index].entry.value;
+        }
+
+        if ((this->count + 1) * MAX_LOAD_DENOMINATOR > this->slots.size() * MAX_LOAD_NUMERATOR)
+        {
+            this->rehash(this->slots.size() * 2);
+            this->locate(key, index);
+        }
+
+        auto& slot = this->slots[index];
+        slot.entry.key = key;
+        slot.entry.value = move(value);
+        slot.used = true;
+        this->count++;
+        return slot.entry.value;
+    }
+
+    bool erase(const Key& key)
+    {
+        size_t index;
+        if (!this->locate(key, index))
+            return false;
+
+        // Backward-shift deletion: pull later members of the probe run into
+        // the hole so that every remaining entry stays reachable.
+        const size_t mask = this->slots.size() - 1;
+        size_t hole = index;
+        size_t next = (hole + 1) & mask;
+        while (this->slots[next].used)
+        {
+            size_t home = this->hasher(this->slots[next].entry.key) & mask;
+            if (((next - home) & mask) >= ((next - hole) & mask))
+            {
+                this->slots[hole] = move(this->slots[next]);
+                hole = next;
+            }
+            next = (next + 1) & mask;
+        }
+        this->slots[hole] = Slot();
+        this->count--;
+        return true;
+    }
+
+private:
+
+    static constexpr size_t MIN_CAPACITY = 16;
+    static constexpr size_t MAX_LOAD_NUMERATOR = 3;
+    static constexpr size_t MAX_LOAD_DENOMINATOR = 4;
+
+    // Finds the slot holding the key, or the free slot where it would go:
+    bool locate(const Key& key, size_t& index) const
+    {
+        const size_t mask = this->slots.size() - 1;
+        index = this->hasher(key) & mask;
+        while (this->slots[index].used)
+        {
+            if (this->slots[index].entry.key == key)
+                return true;
+            index = (index + 1) & mask;
+        }
+        return false;
+    }
+
+    void rehash(size_t new_capacity)
+    {
+        vector<Slot> old_slots(new_capacity);
+        old_slots.swap(this->slots);
+
+        const size_t mask = new_capacity - 1;
+        for (auto& old_slot : old_slots)
+        {
+            if (!old_slot.used)
+                continue;
+
+            size_t index = this->hasher(old_slot.entry.key) & mask;
+            while (this->slots[index].used)
+                index = (index + 1) & mask;
+            this->slots[index] = move(old_slot);
+        }
+    }
+
+    vector<Slot> slots;
+    size_t count = 0;
+    Hash hasher;
+};
+
+} // namespace conntrackex
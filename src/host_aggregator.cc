@@ -0,0 +1,268 @@
+#include "host_aggregator.h"
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <stdexcept>
+
+#include "text_format.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+namespace {
+
+// How many counters the sketch keeps per exported top host. More counters
+// make the top-K more accurate under churn, at a fixed cost in memory.
+const size_t COUNTERS_PER_TOP_HOST = 4;
+
+// Counts are halved after this many new connections per counter, so hosts
+// that were busy long ago give way to the ones that are busy now.
+const uint64_t DECAY_WEIGHT_PER_COUNTER = 64;
+
+} // namespace
+
+HostKey HostKey::other()
+{
+    HostKey key;
+    key.prefix_length = 0;
+    key.flags = OTHER;
+    return key;
+}
+
+string HostKey::toString() const
+{
+    if (this->flags & OTHER)
+        return "other";
+
+    // "ip/prefix:port", with the prefix and port left out when not needed:
+    char buffer[MAX_ENDPOINT_LENGTH + 3];
+    char* output = formatIPv4(buffer, this->ip);
+    if (this->prefix_length < 32)
+    {
+        *output++ = '/';
+        output = formatUInt(output, this->prefix_length);
+    }
+    if (this->flags & HAS_PORT)
+    {
+        *output++ = ':';
+        output = formatUInt(output, ntohs(this->port));
+    }
+    return string(buffer, output - buffer);
+}
+
+void HostAggregator::setPrefixLength(unsigned prefix_length)
+{
+    if (prefix_length > 32)
+        throw runtime_error("Host prefix length must be between 0 and 32.");
+    this->prefix_length = prefix_length;
+}
+
+void HostAggregator::setTopHosts(size_t top_hosts)
+{
+    this->top_hosts = top_hosts;
+    this->counters.clear();
+    this->heap.clear();
+    this->counter_index.clear();
+    this->members.clear();
+    this->member_index.clear();
+    this->member_floor = 0;
+
+    size_t capacity = top_hosts * COUNTERS_PER_TOP_HOST;
+    this->counters.reserve(capacity);
+    this->heap.reserve(capacity);
+    this->counter_index.reserve(capacity);
+    this->members.reserve(top_hosts);
+    this->member_index.reserve(top_hosts);
+}
+
+HostKey HostAggregator::aggregate(const Connection& connection)
+{
+    HostKey key = this->getAggregateKey(connection);
+    if (this->top_hosts == 0)
+        return key;
+
+    if (!this->multiple_tables)
+        return this->rankHost(key);
+
+    lock_guard<mutex> lock(this->tables_mutex);
+    return this->rankHost(key);
+}
+
+HostKey HostAggregator::rankHost(const HostKey& key)
+{
+    size_t counter_id = this->recordHeavyHitter(key);
+    if (this->member_index.find(key) || this->admit(key, counter_id))
+        return key;
+    return HostKey::other();
+}
+
+HostKey HostAggregator::getAggregateKey(const Connection& connection) const
+{
+    auto& remote = connection.getRemoteEndpoint();
+
+    HostKey key;
+    key.prefix_length = this->prefix_length;
+    key.ip = remote.ip & htonl(this->prefix_length ? (0xFFFFFFFFu << (32 - this->prefix_length)) : 0);
+    key.port = remote.port;
+
+    if (this->drop_ephemeral_ports && connection.isInbound())
+    {
+        key.port = 0;
+        key.flags &= ~HostKey::HAS_PORT;
+    }
+
+    return key;
+}
+
+size_t HostAggregator::recordHeavyHitter(const HostKey& key)
+{
+    size_t capacity = this->top_hosts * COUNTERS_PER_TOP_HOST;
+    size_t counter_id;
+
+    auto existing = this->counter_index.find(key);
+    if (existing)
+    {
+        counter_id = *existing;
+        this->counters[counter_id].count++;
+        this->siftDown(this->counters[counter_id].heap_position);
+    }
+    else if (this->counters.size() < capacity)
+    {
+        // Still room for another counter; new counters start at the bottom
+        // of the heap and bubble up past anything with a higher count:
+        counter_id = this->counters.size();
+        this->counters.push_back({key, 1, 0, this->heap.size()});
+        this->heap.push_back(counter_id);
+        this->counter_index.insert(key, counter_id);
+
+        size_t position = this->heap.size() - 1;
+        while (position > 0)
+        {
+            size_t parent = (position - 1) / 2;
+            if (this->counters[this->heap[parent]].count <= this->counters[this->heap[position]].count)
+                break;
+            swap(this->heap[parent], this->heap[position]);
+            this->counters[this->heap[parent]].heap_position = parent;
+            this->counters[this->heap[position]].heap_position = position;
+            position = parent;
+        }
+    }
+    else
+    {
+        // Space-Saving: the new host takes over the smallest counter, and
+        // inherits its count as the possible overestimation.
+        counter_id = this->heap[0];
+        auto& counter = this->counters[counter_id];
+        this->counter_index.erase(counter.key);
+        counter.key = key;
+        counter.error = counter.count;
+        counter.count++;
+        this->counter_index.insert(key, counter_id);
+        this->siftDown(0);
+    }
+
+    if (++this->updates_since_floor >= capacity)
+        this->updateMemberFloor();
+    if (++this->weight_since_decay >= capacity * DECAY_WEIGHT_PER_COUNTER)
+        this->decay();
+
+    return counter_id;
+}
+
+bool HostAggregator::admit(const HostKey& key, size_t counter_id)
+{
+    if (this->members.size() < this->top_hosts)
+    {
+        this->member_index.insert(key, this->members.size());
+        this->members.push_back(key);
+        return true;
+    }
+
+    // The newcomer must have had more connections for sure than the weakest
+    // member can have had at most:
+    auto& counter = this->counters[counter_id];
+    uint64_t guaranteed_count = counter.count - counter.error;
+    if (guaranteed_count <= this->member_floor)
+        return false;
+
+    size_t weakest = 0;
+    uint64_t weakest_bound = this->getUpperBound(this->members[0]);
+    for (size_t i = 1; i < this->members.size(); i++)
+    {
+        uint64_t bound = this->getUpperBound(this->members[i]);
+        if (bound < weakest_bound)
+        {
+            weakest = i;
+            weakest_bound = bound;
+        }
+    }
+    this->member_floor = weakest_bound;
+    if (guaranteed_count <= weakest_bound)
+        return false;
+
+    this->member_index.erase(this->members[weakest]);
+    this->members[weakest] = key;
+    this->member_index.insert(key, weakest);
+    return true;
+}
+
+uint64_t HostAggregator::getUpperBound(const HostKey& member) const
+{
+    // A host the sketch no longer tracks can't have been counted more often
+    // than its smallest counter:
+    auto counter_id = this->counter_index.find(member);
+    if (counter_id)
+        return this->counters[*counter_id].count;
+    return this->counters[this->heap[0]].count;
+}
+
+void HostAggregator::siftDown(size_t position)
+{
+    while (true)
+    {
+        size_t smallest = position;
+        for (size_t child = 2 * position + 1; child <= 2 * position + 2 && child < this->heap.size(); child++)
+        {
+            if (this->counters[this->heap[child]].count < this->counters[this->heap[smallest]].count)
+                smallest = child;
+        }
+        if (smallest == position)
+            return;
+
+        swap(this->heap[smallest], this->heap[position]);
+        this->counters[this->heap[smallest]].heap_position = smallest;
+        this->counters[this->heap[position]].heap_position = position;
+        position = smallest;
+    }
+}
+
+void HostAggregator::updateMemberFloor()
+{
+    // Members' bounds only grow between decays, so this stays a lower bound
+    // until the next update:
+    this->updates_since_floor = 0;
+    if (this->members.empty())
+        return;
+
+    uint64_t floor = this->getUpperBound(this->members[0]);
+    for (auto& member : this->members)
+        floor = min(floor, this->getUpperBound(member));
+    this->member_floor = floor;
+}
+
+void HostAggregator::decay()
+{
+    this->weight_since_decay = 0;
+    for (auto& counter : this->counters)
+    {
+        counter.count /= 2;
+        counter.error /= 2;
+    }
+
+    // Halving keeps the order, so the heap is still valid.
+    this->updateMemberFloor();
+}
+
+} // namespace conntrackex
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "connection.h"
+#include "flat_hash_map.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// The remote host series a connection is counted under. Depending on the
+// aggregation settings this is an exact ip:port, a network prefix, an
+// address without its port, or the catch-all "other" bucket.
+struct HostKey
+{
+    enum : uint8_t
+    {
+        HAS_PORT = 1 << 0,
+        OTHER = 1 << 1
+    };
+
+    uint32_t ip = 0;    // network byte order, masked to the prefix length
+    uint16_t port = 0;  // network byte order
+    uint8_t prefix_length = 32;
+    uint8_t flags = HAS_PORT;
+
+    bool operator==(const HostKey& other) const
+    {
+        return this->ip == other.ip && this->port == other.port &&
+               this->prefix_length == other.prefix_length && this->flags == other.flags;
+    }
+    bool operator!=(const HostKey& other) const { return !(*this == other); }
+
+    static HostKey other();
+    string toString() const;
+};
+
+struct HostKeyHash
+{
+    size_t operator()(const HostKey& key) const
+    {
+        uint64_t hash = (static_cast<uint64_t>(key.ip) << 32) ^
+                        (static_cast<uint64_t>(key.port) << 16) ^
+                        (static_cast<uint64_t>(key.prefix_length) << 8) ^ key.flags;
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDULL;
+        hash ^= hash >> 33;
+        return static_cast<size_t>(hash);
+    }
+};
+
+// Maps remote endpoints to the host series they're exported as, bounding the
+// number of series however many distinct clients connect.
+//
+// With a top-K limit, a Space-Saving sketch over new connections estimates
+// how busy each host is in fixed memory, and at most K hosts are members of
+// the top at a time. Only members get their own series; every other host is
+// counted under "other". A newcomer only joins by displacing the member
+// whose count is provably lower than its own, so a stream of one-off
+// clients can't cycle through the top. A host keeps the series it was
+// assigned when a connection was first counted until that connection ends,
+// so counts always come back out of the series they went into.
+class HostAggregator
+{
+public:
+
+    void setPrefixLength(unsigned prefix_length);
+    void setDropEphemeralPorts(bool enable = true) { this->drop_ephemeral_ports = enable; }
+    void setTopHosts(size_t top_hosts);
+
+    // Needed when tables on several ingestion threads share this one:
+    void setMultipleTables(bool multiple_tables) { this->multiple_tables = multiple_tables; }
+
+    // Picks the series for a connection that is about to be counted:
+    HostKey aggregate(const Connection& connection);
+
+private:
+
+    struct Counter
+    {
+        HostKey key;
+        uint64_t count;
+        uint64_t error;
+        size_t heap_position;
+    };
+
+    HostKey getAggregateKey(const Connection& connection) const;
+    HostKey rankHost(const HostKey& key);
+    size_t recordHeavyHitter(const HostKey& key);
+    bool admit(const HostKey& key, size_t counter_id);
+    uint64_t getUpperBound(const HostKey& member) const;
+    void siftDown(size_t position);
+    void updateMemberFloor();
+    void decay();
+
+    unsigned prefix_length = 32;
+    bool drop_ephemeral_ports = false;
+    size_t top_hosts = 0;
+    bool multiple_tables = false;
+    mutex tables_mutex;
+
+    // Space-Saving state: counters live in a min-heap on count, indexed by key.
+    vector<Counter> counters;
+    vector<size_t> heap;
+    FlatHashMap<HostKey, size_t, HostKeyHash> counter_index;
+    uint64_t weight_since_decay = 0;
+
+    // The hosts currently in the top, at most top_hosts of them, indexed by
+    // key. member_floor is at most the smallest upper bound on a member's
+    // count, so newcomers whose guaranteed count doesn't beat it can be
+    // turned away without looking at the members.
+    vector<HostKey> members;
+    FlatHashMap<HostKey, size_t, HostKeyHash> member_index;
+    uint64_t member_floor = 0;
+    uint64_t updates_since_floor = 0;
+};
+
+} // namespace conntrackex
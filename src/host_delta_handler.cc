@@ -0,0 +1,112 @@
+#include "host_delta_handler.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <civetweb.h>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+namespace {
+
+// Don't let a long-poll hold its server thread for long:
+const unsigned long MAX_WAIT_SECONDS = 60;
+
+void appendHost(string& output, const string& label, const uint32_t* counts)
+{
+    if (output.back() != '[')
+        output += ',';
+    output += "{\"host\":\"" + label + "\"";
+    output += ",\"opening\":" + to_string(counts[0]);
+    output += ",\"open\":" + to_string(counts[1]);
+    output += ",\"closing\":" + to_string(counts[2]);
+    output += ",\"closed\":" + to_string(counts[3]);
+    output += '}';
+}
+
+} // namespace
+
+bool HostDeltaHandler::handleGet(CivetServer* /*server*/, struct mg_connection* connection)
+{
+    auto request = mg_get_request_info(connection);
+    const char* query = (request && request->query_string) ? request->query_string : "";
+
+    char value[32];
+    uint64_t since = 0;
+    if (mg_get_var(query, strlen(query), "since", value, sizeof(value)) > 0)
+        since = strtoull(value, nullptr, 10);
+    unsigned long wait_seconds = 0;
+    if (mg_get_var(query, strlen(query), "wait", value, sizeof(value)) > 0)
+        wait_seconds = min<unsigned long>(strtoul(value, nullptr, 10), MAX_WAIT_SECONDS);
+
+    // Anything but the own namespace, whose name is empty (or too long to
+    // fit, which can't be ours either):
+    int namespace_length = mg_get_var(query, strlen(query), "namespace", value, sizeof(value));
+    if (namespace_length > 0 || namespace_length == -2)
+    {
+        const char* message = "Host deltas cover the exporter's own network namespace only.\n";
+        mg_printf(connection,
+            "HTTP/1.1 400 Bad Request\r\n"
+            "Content-Type: text/plain\r\n"
+            "Content-Length: %zu\r\n"
+            "\r\n"
+            "%s",
+            strlen(message), message);
+        return true;
+    }
+
+    // Scrapes must still find a free thread however many clients poll:
+    bool is_waiter = (wait_seconds > 0);
+    if (is_waiter && this->waiters.fetch_add(1) >= this->max_waiters)
+    {
+        this->waiters--;
+        is_waiter = false;
+        wait_seconds = 0;
+    }
+    string body = this->render(since, chrono::seconds(wait_seconds));
+    if (is_waiter)
+        this->waiters--;
+
+    mg_printf(connection,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Cache-Control: no-store\r\n"
+        "Content-Length: %zu\r\n"
+        "\r\n",
+        body.size());
+    mg_write(connection, body.data(), body.size());
+
+    return true;
+}
+
+string HostDeltaHandler::render(uint64_t since, chrono::milliseconds wait) const
+{
+    vector<HostDelta> changes;
+    uint64_t generation = 0;
+    bool full = (since == 0 || !this->table.getDeltaLog() ||
+                 !this->table.getDeltaLog()->getChanges(since, wait, changes, generation));
+
+    string output;
+    if (full)
+    {
+        // The snapshot is published after its deltas, so changes after its
+        // generation are still to come in the log:
+        auto snapshot = this->table.waitForSnapshot(this->table.requestSnapshot(), chrono::seconds(1));
+        output = "{\"generation\":" + to_string(snapshot->generation) + ",\"namespace\":\"\",\"full\":true,\"hosts\":[";
+        for (auto& host : snapshot->hosts)
+            appendHost(output, *host.label, host.counts.counts);
+    }
+    else
+    {
+        output = "{\"generation\":" + to_string(generation) + ",\"namespace\":\"\",\"full\":false,\"hosts\":[";
+        for (auto& change : changes)
+            appendHost(output, *change.label, change.counts);
+    }
+    output += "]}\n";
+    return output;
+}
+
+} // namespace conntrackex
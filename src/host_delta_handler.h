@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include <CivetServer.h>
+
+#include "connection_table.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// Serves the per-host state counts that changed since the generation a
+// client last saw, as JSON, for consumers that poll too often to re-read
+// the whole exposition each time:
+//
+//   GET <path>?since=<generation>&wait=<seconds>
+//
+// With wait, the request is held until something changes or the time is
+// up. Each waiting request holds a server thread, so once max_waiters are
+// waiting, further requests are answered right away instead. A since of 0, or one the table's delta log no longer covers, gets
+// every host, marked "full". The response's generation is the one to ask
+// from next.
+//
+// Only the exporter's own table keeps a delta log: generations are per
+// table, so there's no single "since" to ask other namespaces' tables
+// from. Responses say so with an empty "namespace", and requests for any
+// other namespace are rejected.
+class HostDeltaHandler : public CivetHandler
+{
+public:
+
+    HostDeltaHandler(const ConnectionTable& table, unsigned max_waiters) :
+        table(table),
+        max_waiters(max_waiters)
+    {}
+
+    bool handleGet(CivetServer* server, struct mg_connection* connection) override;
+
+private:
+
+    string render(uint64_t since, chrono::milliseconds wait) const;
+
+    const ConnectionTable& table;
+    const unsigned max_waiters;
+    atomic<unsigned> waiters{0};
+};
+
+} // namespace conntrackex
@@ -0,0 +1,60 @@
+#include "host_delta_log.h"
+
+#include <algorithm>
+
+#include "flat_hash_map.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+void HostDeltaLog::append(const vector<HostDelta>& deltas, uint64_t generation)
+{
+    {
+        lock_guard<mutex> lock(this->entries_mutex);
+        for (auto& delta : deltas)
+        {
+            auto& entry = this->entries[this->next];
+            if (this->count == this->entries.size())
+                this->overwritten_up_to = max(this->overwritten_up_to, entry.generation);
+            else
+                this->count++;
+
+            entry = delta;
+            this->last_change = max(this->last_change, delta.generation);
+            this->next = (this->next + 1) % this->entries.size();
+        }
+        this->generation = generation;
+    }
+
+    if (!deltas.empty())
+        this->appended.notify_all();
+}
+
+bool HostDeltaLog::getChanges(uint64_t since, chrono::milliseconds timeout, vector<HostDelta>& changes, uint64_t& generation) const
+{
+    unique_lock<mutex> lock(this->entries_mutex);
+    // A generation from the future is from before a restart:
+    auto is_stale = [&]() { return since < this->overwritten_up_to || since > this->generation; };
+    this->appended.wait_for(lock, timeout, [&]() { return this->last_change > since || is_stale(); });
+
+    generation = this->generation;
+    if (is_stale())
+        return false;
+
+    // Newest first, so the first delta seen for a host is its latest:
+    FlatHashMap<HostKey, bool, HostKeyHash> seen;
+    for (size_t i = 1; i <= this->count; i++)
+    {
+        auto& entry = this->entries[(this->next + this->entries.size() - i) % this->entries.size()];
+        if (entry.generation <= since || seen.find(entry.host))
+            continue;
+
+        seen.insert(entry.host, true);
+        changes.push_back(entry);
+    }
+    return true;
+}
+
+} // namespace conntrackex
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "host_aggregator.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// A host's state counts as of its latest change, indexed by ConnectionState.
+struct HostDelta
+{
+    uint64_t generation = 0; // table generation of the change
+    HostKey host;
+    shared_ptr<const string> label;
+    uint32_t counts[4] = {};
+};
+
+// A bounded ring of the per-host changes the table has published, so that
+// clients can fetch only what changed since the generation they last saw.
+// The table appends to it when it publishes a snapshot; any thread may read
+// it, and readers can wait for the next change.
+class HostDeltaLog
+{
+public:
+
+    HostDeltaLog(size_t capacity) : entries(capacity) {}
+
+    void append(const vector<HostDelta>& deltas, uint64_t generation);
+
+    // Fills in the latest delta of each host that changed after `since`,
+    // waiting up to `timeout` for one if there are none yet, along with the
+    // generation to ask from next time. Returns false if some of those
+    // changes have already been overwritten, or `since` isn't one of ours.
+    bool getChanges(uint64_t since, chrono::milliseconds timeout, vector<HostDelta>& changes, uint64_t& generation) const;
+
+private:
+
+    mutable mutex entries_mutex;
+    mutable condition_variable appended;
+    vector<HostDelta> entries;
+    size_t next = 0;               // where the next entry goes
+    size_t count = 0;
+    uint64_t generation = 0;       // of the last append
+    uint64_t last_change = 0;      // newest generation in the ring
+    uint64_t overwritten_up_to = 0; // newest generation no longer in the ring
+};
+
+} // namespace conntrackex
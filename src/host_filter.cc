@@ -0,0 +1,330 @@
+#include "host_filter.h"
+
+#include <arpa/inet.h>
+#include <algorithm>
+#include <stdexcept>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+constexpr size_t HostFilter::MAX_KERNEL_IPV4_RULES;
+constexpr size_t HostFilter::MAX_KERNEL_IPV6_RULES;
+
+namespace {
+
+bool prefixMatches(const uint8_t* address, const uint8_t* prefix, unsigned prefix_length)
+{
+    unsigned full_bytes = prefix_length / 8;
+    if (memcmp(address, prefix, full_bytes) != 0)
+        return false;
+
+    unsigned remaining_bits = prefix_length % 8;
+    if (remaining_bits == 0)
+        return true;
+
+    uint8_t mask = static_cast<uint8_t>(0xFF << (8 - remaining_bits));
+    return (address[full_bytes] & mask) == (prefix[full_bytes] & mask);
+}
+
+} // namespace
+
+IgnoreRule IgnoreRule::parse(const string& text)
+{
+    IgnoreRule rule;
+    string address = text;
+    string port;
+
+    // Split off the port, if there is one:
+    if (!address.empty() && address[0] == '[')
+    {
+        auto closing = address.find(']');
+        if (closing == string::npos)
+            throw runtime_error("Invalid ignored host '" + text + "': missing ']'");
+        if (closing + 1 < address.size())
+        {
+            if (address[closing + 1] != ':')
+                throw runtime_error("Invalid ignored host '" + text + "'");
+            port = address.substr(closing + 2);
+        }
+        address = address.substr(1, closing - 1);
+    }
+    else if (count(address.begin(), address.end(), ':') == 1)
+    {
+        auto colon = address.find(':');
+        port = address.substr(colon + 1);
+        address = address.substr(0, colon);
+    }
+
+    // Any address, for port rules:
+    if (address == "*")
+    {
+        rule.prefix_length = 0;
+        address = "0.0.0.0/0";
+    }
+
+    // ...and the prefix length:
+    string prefix_length;
+    auto slash = address.find('/');
+    if (slash != string::npos)
+    {
+        prefix_length = address.substr(slash + 1);
+        address = address.substr(0, slash);
+    }
+
+    if (inet_pton(AF_INET, address.c_str(), rule.address) == 1)
+        rule.family = AF_INET;
+    else if (inet_pton(AF_INET6, address.c_str(), rule.address) == 1)
+        rule.family = AF_INET6;
+    else
+        throw runtime_error("Invalid ignored host '" + text + "': bad address");
+
+    unsigned max_prefix_length = (rule.family == AF_INET) ? 32 : 128;
+    rule.prefix_length = max_prefix_length;
+    if (!prefix_length.empty())
+    {
+        if (prefix_length.find_first_not_of("0123456789") != string::npos ||
+            prefix_length.size() > 3 ||
+            stoul(prefix_length) > max_prefix_length)
+            throw runtime_error("Invalid ignored host '" + text + "': bad prefix length");
+        rule.prefix_length = stoul(prefix_length);
+    }
+
+    if (!port.empty())
+    {
+        if (port.find_first_not_of("0123456789") != string::npos ||
+            port.size() > 5 ||
+            stoul(port) == 0 || stoul(port) > 65535)
+            throw runtime_error("Invalid ignored host '" + text + "': bad port");
+        rule.port = htons(static_cast<uint16_t>(stoul(port)));
+    }
+
+    return rule;
+}
+
+bool IgnoreRule::matches(const Endpoint& endpoint) const
+{
+    if (this->family != AF_INET)
+        return false;
+    if (this->port != 0 && this->port != endpoint.port)
+        return false;
+
+    return prefixMatches(reinterpret_cast<const uint8_t*>(&endpoint.ip), this->address, this->prefix_length);
+}
+
+string IgnoreRule::toString() const
+{
+    char address_str[INET6_ADDRSTRLEN] = "";
+    inet_ntop(this->family, this->address, address_str, sizeof(address_str));
+
+    string output = address_str;
+    if (this->family == AF_INET && this->prefix_length == 0)
+        output = "*";
+    unsigned max_prefix_length = (this->family == AF_INET) ? 32 : 128;
+    if (this->prefix_length != max_prefix_length && output != "*")
+        output += "/" + to_string(this->prefix_length);
+    if (this->port != 0)
+        output = ((this->family == AF_INET6) ? "[" + output + "]" : output) + ":" + to_string(ntohs(this->port));
+
+    return output;
+}
+
+bool HostFilter::PortSet::contains(uint16_t port) const
+{
+    return this->all_ports || binary_search(this->ports.begin(), this->ports.end(), port);
+}
+
+uint32_t HostFilter::addPorts(uint32_t port_set, const PortSet& ports)
+{
+    if (this->port_sets.empty())
+    {
+        this->port_sets.emplace_back();
+        this->port_set_ids[PortSet()] = 0;
+    }
+
+    PortSet merged = this->port_sets[port_set];
+    merged.all_ports |= ports.all_ports;
+    if (merged.all_ports)
+        merged.ports.clear();
+    else
+    {
+        for (auto port : ports.ports)
+        {
+            auto position = lower_bound(merged.ports.begin(), merged.ports.end(), port);
+            if (position == merged.ports.end() || *position != port)
+                merged.ports.insert(position, port);
+        }
+    }
+
+    auto existing = this->port_set_ids.find(merged);
+    if (existing != this->port_set_ids.end())
+        return existing->second;
+
+    uint32_t id = static_cast<uint32_t>(this->port_sets.size());
+    this->port_sets.push_back(merged);
+    this->port_set_ids[merged] = id;
+    return id;
+}
+
+void HostFilter::add(const IgnoreRule& rule)
+{
+    this->rules.push_back(rule);
+
+    // Only IPv4 remote hosts are tracked, so IPv6 rules only ever matter to
+    // the kernel filter:
+    if (rule.family != AF_INET)
+        return;
+
+    if (rule.prefix_length == 0 && rule.port != 0)
+    {
+        this->any_address_ports.set(rule.port);
+        return;
+    }
+
+    PortSet ports;
+    ports.all_ports = (rule.port == 0);
+    if (rule.port != 0)
+        ports.ports.push_back(rule.port);
+
+    if (this->trie.empty())
+        this->trie.emplace_back();
+
+    // Walk down to the level holding the prefix's last byte...
+    size_t node = 0;
+    unsigned level = 0;
+    while (rule.prefix_length > 8 * (level + 1))
+    {
+        uint8_t byte = rule.address[level];
+        if (this->trie[node].slots[byte].child < 0)
+        {
+            this->trie[node].slots[byte].child = static_cast<int32_t>(this->trie.size());
+            this->trie.emplace_back();
+        }
+        node = this->trie[node].slots[byte].child;
+        level++;
+    }
+
+    // ...and add the ports to every slot the prefix covers there:
+    unsigned remaining_bits = rule.prefix_length - 8 * level;
+    unsigned first = remaining_bits ? (rule.address[level] & (0xFF << (8 - remaining_bits)) & 0xFF) : 0;
+    unsigned count = 1u << (8 - remaining_bits);
+    for (unsigned byte = first; byte < first + count; byte++)
+    {
+        auto& slot = this->trie[node].slots[byte];
+        slot.port_set = this->addPorts(slot.port_set, ports);
+    }
+}
+
+bool HostFilter::matches(const Endpoint& endpoint) const
+{
+    if (this->any_address_ports.test(endpoint.port))
+        return true;
+    if (this->trie.empty())
+        return false;
+
+    // Shorter prefixes are checked on the way down to longer ones:
+    auto address = reinterpret_cast<const uint8_t*>(&endpoint.ip);
+    int32_t node = 0;
+    for (unsigned level = 0; level < 4 && node >= 0; level++)
+    {
+        auto& slot = this->trie[node].slots[address[level]];
+        if (slot.port_set && this->port_sets[slot.port_set].contains(endpoint.port))
+            return true;
+        node = slot.child;
+    }
+    return false;
+}
+
+vector<IgnoreRule> HostFilter::getKernelRules(const LocalAddressSet& local_addresses) const
+{
+    vector<IgnoreRule> kernel_rules;
+    size_t ipv4_rules = 0;
+    size_t ipv6_rules = 0;
+
+    for (auto& rule : this->rules)
+    {
+        if (rule.port != 0)
+            continue;
+
+        bool covers_local_address = false;
+        if (rule.family == AF_INET)
+        {
+            for (auto& entry : local_addresses.getIPv4Addresses())
+                covers_local_address |= prefixMatches(reinterpret_cast<const uint8_t*>(&entry.key), rule.address, rule.prefix_length);
+        }
+        else
+        {
+            for (auto& entry : local_addresses.getIPv6Addresses())
+                covers_local_address |= prefixMatches(entry.key.bytes, rule.address, rule.prefix_length);
+        }
+        if (covers_local_address)
+            continue;
+
+        if (rule.family == AF_INET && ipv4_rules < MAX_KERNEL_IPV4_RULES)
+        {
+            kernel_rules.push_back(rule);
+            ipv4_rules++;
+        }
+        else if (rule.family == AF_INET6 && ipv6_rules < MAX_KERNEL_IPV6_RULES)
+        {
+            kernel_rules.push_back(rule);
+            ipv6_rules++;
+        }
+    }
+
+    return kernel_rules;
+}
+
+void HostFilter::compile(nfct_filter* filter, const vector<IgnoreRule>& kernel_rules)
+{
+    bool has_ipv4_rules = false;
+    bool has_ipv6_rules = false;
+
+    for (auto& rule : kernel_rules)
+    {
+        if (rule.family == AF_INET)
+        {
+            // The kernel filter wants IPv4 addresses and masks in host byte order:
+            uint32_t address;
+            memcpy(&address, rule.address, sizeof(address));
+            struct nfct_filter_ipv4 filter_ipv4;
+            filter_ipv4.mask = rule.prefix_length ? (0xFFFFFFFFu << (32 - rule.prefix_length)) : 0;
+            filter_ipv4.addr = ntohl(address) & filter_ipv4.mask;
+
+            nfct_filter_add_attr(filter, NFCT_FILTER_SRC_IPV4, &filter_ipv4);
+            nfct_filter_add_attr(filter, NFCT_FILTER_DST_IPV4, &filter_ipv4);
+            has_ipv4_rules = true;
+        }
+        else
+        {
+            struct nfct_filter_ipv6 filter_ipv6;
+            for (int word = 0; word < 4; word++)
+            {
+                uint32_t address;
+                memcpy(&address, rule.address + word * 4, sizeof(address));
+                int bits = max(0, min(32, static_cast<int>(rule.prefix_length) - word * 32));
+                filter_ipv6.mask[word] = bits ? (0xFFFFFFFFu << (32 - bits)) : 0;
+                filter_ipv6.addr[word] = ntohl(address) & filter_ipv6.mask[word];
+            }
+
+            nfct_filter_add_attr(filter, NFCT_FILTER_SRC_IPV6, &filter_ipv6);
+            nfct_filter_add_attr(filter, NFCT_FILTER_DST_IPV6, &filter_ipv6);
+            has_ipv6_rules = true;
+        }
+    }
+
+    // Drop events whose original source or destination matches any rule:
+    if (has_ipv4_rules)
+    {
+        nfct_filter_set_logic(filter, NFCT_FILTER_SRC_IPV4, NFCT_FILTER_LOGIC_NEGATIVE);
+        nfct_filter_set_logic(filter, NFCT_FILTER_DST_IPV4, NFCT_FILTER_LOGIC_NEGATIVE);
+    }
+    if (has_ipv6_rules)
+    {
+        nfct_filter_set_logic(filter, NFCT_FILTER_SRC_IPV6, NFCT_FILTER_LOGIC_NEGATIVE);
+        nfct_filter_set_logic(filter, NFCT_FILTER_DST_IPV6, NFCT_FILTER_LOGIC_NEGATIVE);
+    }
+}
+
+} // namespace conntrackex
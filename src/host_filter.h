@@ -0,0 +1,100 @@
+#pragma once
+
+#include <bitset>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "connection.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// A single --ignore-hosts entry: an IPv4 or IPv6 address or CIDR block, or
+// "*" for any address, optionally restricted to one port.
+struct IgnoreRule
+{
+    int family = AF_INET;
+    uint8_t address[16] = {}; // network byte order
+    unsigned prefix_length = 32;
+    uint16_t port = 0;        // network byte order; 0 matches any port
+
+    // Accepts "ip", "ip:port", "ip/len", "ip/len:port", "*:port" and, for
+    // IPv6, the same with the address in brackets when a port follows
+    // ("[ip]:port").
+    static IgnoreRule parse(const string& text);
+
+    bool matches(const Endpoint& endpoint) const;
+    string toString() const;
+};
+
+// The set of remote hosts to ignore. Address-only rules can also be compiled
+// into a netfilter_conntrack socket filter so the kernel drops their events
+// before they are ever copied to us; the rest are matched in userspace.
+//
+// For matching, IPv4 rules are compiled as they're added into a multibit
+// trie over the address, one level per byte, with each rule's prefix
+// expanded over the slots it covers. Each slot points to the set of ports
+// ignored there, so a lookup is at most four node visits plus a port check,
+// however many rules there are. Rules for a port on any address are a
+// bitmap checked before the trie.
+class HostFilter
+{
+public:
+
+    void add(const IgnoreRule& rule);
+    bool empty() const { return this->rules.empty(); }
+    bool matches(const Endpoint& endpoint) const;
+
+    // The rules the kernel can express, up to as many as its filter takes.
+    // Rules covering a local address are left out, since the kernel can only
+    // match on the original tuple and would drop all of our own traffic
+    // along with them. The kernel drops an event if either address of the
+    // original tuple matches, which only agrees with matches() when that
+    // tuple names a local address, i.e. without NAT or forwarding.
+    vector<IgnoreRule> getKernelRules(const LocalAddressSet& local_addresses) const;
+
+    // Adds rules from getKernelRules() to the filter:
+    static void compile(nfct_filter* filter, const vector<IgnoreRule>& kernel_rules);
+
+private:
+
+    // Upper bounds on the address entries libnetfilter_conntrack accepts
+    // per direction:
+    static constexpr size_t MAX_KERNEL_IPV4_RULES = 127;
+    static constexpr size_t MAX_KERNEL_IPV6_RULES = 20;
+
+    // Ports in network byte order, as in Endpoint:
+    struct PortSet
+    {
+        bool all_ports = false;
+        vector<uint16_t> ports; // sorted, when not all_ports
+
+        bool contains(uint16_t port) const;
+        bool operator<(const PortSet& other) const { return tie(this->all_ports, this->ports) < tie(other.all_ports, other.ports); }
+    };
+
+    struct TrieSlot
+    {
+        int32_t child = -1;     // node for the next byte, if any rule goes deeper
+        uint32_t port_set = 0;  // ports ignored for addresses through here; 0 for none
+    };
+
+    struct TrieNode
+    {
+        TrieSlot slots[256];
+    };
+
+    uint32_t addPorts(uint32_t port_set, const PortSet& ports);
+
+    vector<IgnoreRule> rules;
+    bitset<65536> any_address_ports;
+    vector<TrieNode> trie;            // the root is node 0
+    vector<PortSet> port_sets;        // deduplicated; entry 0 is empty
+    map<PortSet, uint32_t> port_set_ids;
+};
+
+} // namespace conntrackex
@@ -0,0 +1,50 @@
+#include "host_interner.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+const uint32_t HostInterner::NONE;
+
+uint32_t HostInterner::acquire(const HostKey& host)
+{
+    if (auto id = this->ids.find(host))
+    {
+        this->entries[*id].references++;
+        return *id;
+    }
+
+    uint32_t id;
+    if (!this->free_ids.empty())
+    {
+        id = this->free_ids.back();
+        this->free_ids.pop_back();
+    }
+    else
+    {
+        id = static_cast<uint32_t>(this->entries.size());
+        this->entries.emplace_back();
+    }
+
+    auto& entry = this->entries[id];
+    entry.host = host;
+    entry.label = make_shared<const string>(host.toString());
+    entry.references = 1;
+    this->ids.insert(host, id);
+    return id;
+}
+
+void HostInterner::release(uint32_t id)
+{
+    auto& entry = this->entries[id];
+    if (--entry.references > 0)
+        return;
+
+    // Snapshots hold references of their own to the label:
+    this->ids.erase(entry.host);
+    entry.label.reset();
+    this->free_ids.push_back(id);
+}
+
+} // namespace conntrackex
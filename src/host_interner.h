@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "flat_hash_map.h"
+#include "host_aggregator.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// Gives every host series a small integer ID for as long as something
+// refers to it, so the table can count by ID instead of hashing host keys,
+// and renders each series' label once, when it's first interned. Released
+// IDs are reused.
+class HostInterner
+{
+public:
+
+    static const uint32_t NONE = UINT32_MAX;
+
+    // Interns the host if needed and adds a reference to its ID:
+    uint32_t acquire(const HostKey& host);
+    void acquire(uint32_t id) { this->entries[id].references++; }
+    void release(uint32_t id);
+
+    const HostKey& getHost(uint32_t id) const { return this->entries[id].host; }
+    const shared_ptr<const string>& getLabel(uint32_t id) const { return this->entries[id].label; }
+
+    // IDs are always below this:
+    size_t getIdLimit() const { return this->entries.size(); }
+    size_t size() const { return this->ids.size(); }
+
+private:
+
+    struct Entry
+    {
+        HostKey host;
+        shared_ptr<const string> label;
+        uint32_t references = 0;
+    };
+
+    FlatHashMap<HostKey, uint32_t, HostKeyHash> ids;
+    vector<Entry> entries;
+    vector<uint32_t> free_ids;
+};
+
+} // namespace conntrackex
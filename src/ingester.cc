@@ -0,0 +1,202 @@
+#include "ingester.h"
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <algorithm>
+#include <iostream>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+constexpr chrono::milliseconds Ingester::DELTA_INTERVAL;
+
+Ingester::Ingester()
+{
+    this->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (this->epoll_fd < 0)
+        throw runtime_error("Unable to create an epoll instance.");
+
+    this->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->wakeup_fd < 0)
+        throw runtime_error("Unable to create an eventfd.");
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = this->wakeup_fd;
+    if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, this->wakeup_fd, &event) != 0)
+        throw runtime_error("Unable to watch the eventfd.");
+}
+
+Ingester::~Ingester()
+{
+    this->stop();
+    close(this->wakeup_fd);
+    close(this->epoll_fd);
+}
+
+void Ingester::start()
+{
+    this->applyChanges();
+
+    this->running = true;
+    this->worker = thread(&Ingester::run, this);
+}
+
+void Ingester::stop()
+{
+    if (!this->running.exchange(false))
+        return;
+
+    this->wakeUp();
+    this->worker.join();
+
+    // Release anyone still waiting on a removal:
+    this->applyChanges();
+}
+
+void Ingester::addTable(ConnectionTable& table)
+{
+    lock_guard<mutex> lock(this->changes_mutex);
+    this->changes.push_back({&table, true});
+    this->requested_changes++;
+    this->table_count++;
+    this->wakeUp();
+}
+
+void Ingester::removeTable(ConnectionTable& table)
+{
+    unique_lock<mutex> lock(this->changes_mutex);
+    this->changes.push_back({&table, false});
+    uint64_t change = ++this->requested_changes;
+    this->table_count--;
+
+    if (!this->running)
+    {
+        lock.unlock();
+        this->applyChanges();
+        return;
+    }
+
+    this->wakeUp();
+    this->changes_applied.wait(lock, [&]() { return this->applied_changes >= change; });
+}
+
+void Ingester::wakeUp()
+{
+    uint64_t wakeup = 1;
+    if (write(this->wakeup_fd, &wakeup, sizeof(wakeup)) < 0)
+        cerr << "[WARNING] Unable to wake up the ingestion thread." << endl;
+}
+
+void Ingester::applyChanges()
+{
+    lock_guard<mutex> lock(this->changes_mutex);
+    for (auto& change : this->changes)
+    {
+        if (change.add)
+            this->watch(*change.table);
+        else
+            this->unwatch(*change.table);
+    }
+    this->changes.clear();
+    this->applied_changes = this->requested_changes;
+    this->changes_applied.notify_all();
+}
+
+void Ingester::watch(ConnectionTable& table)
+{
+    for (int fd : table.getFileDescriptors())
+    {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(this->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+            throw runtime_error("Unable to watch the table's sockets.");
+        this->fd_tables.insert(fd, &table);
+    }
+
+    table.publishSnapshot();
+    this->tables.push_back(&table);
+}
+
+void Ingester::unwatch(ConnectionTable& table)
+{
+    for (int fd : table.getFileDescriptors())
+    {
+        epoll_ctl(this->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        this->fd_tables.erase(fd);
+    }
+
+    this->tables.erase(remove(this->tables.begin(), this->tables.end(), &table), this->tables.end());
+}
+
+void Ingester::run()
+{
+    try
+    {
+        auto next_deltas = chrono::steady_clock::now();
+        struct epoll_event events[16];
+
+        while (this->running)
+        {
+            // Sleep until there are events, snapshot requests included, or
+            // until pending deltas are due to be published:
+            bool has_unpublished_deltas = any_of(this->tables.begin(), this->tables.end(),
+                [](const ConnectionTable* table) { return table->hasUnpublishedDeltas(); });
+            int timeout = -1;
+            if (has_unpublished_deltas)
+            {
+                auto remaining = chrono::duration_cast<chrono::milliseconds>(next_deltas - chrono::steady_clock::now());
+                timeout = max(0, static_cast<int>(remaining.count()));
+            }
+
+            int ready = epoll_wait(this->epoll_fd, events, 16, timeout);
+            if (ready < 0 && errno != EINTR)
+                throw runtime_error("Error waiting for NetFilter events.");
+
+            for (int i = 0; i < ready; i++)
+            {
+                int fd = events[i].data.fd;
+                if (fd == this->wakeup_fd)
+                {
+                    uint64_t wakeups;
+                    if (read(this->wakeup_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+                        throw runtime_error("Error reading the eventfd.");
+                    this->applyChanges();
+                    continue;
+                }
+
+                // A table removed earlier in this batch no longer has an entry:
+                if (auto table = this->fd_tables.find(fd))
+                    (*table)->handleEvents(fd);
+            }
+
+            auto now = chrono::steady_clock::now();
+            if (now >= next_deltas)
+            {
+                bool published = false;
+                for (auto table : this->tables)
+                {
+                    if (table->hasUnpublishedDeltas())
+                    {
+                        table->publishDeltas();
+                        published = true;
+                    }
+                }
+                if (published)
+                    next_deltas = now + DELTA_INTERVAL;
+            }
+        }
+    }
+    catch (const exception& e)
+    {
+        cout << "ERROR: " << e.what() << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+} // namespace conntrackex
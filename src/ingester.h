@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "connection_table.h"
+#include "flat_hash_map.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// Drains conntrack events on a dedicated thread as soon as the kernel queues
+// them. Snapshots of the tables are built when the exporting side asks for
+// them, through the tables' own file descriptors, while per-host deltas are
+// published at most once per delta interval. One ingester can serve
+// several attached tables, which may be added and removed while it runs.
+class Ingester
+{
+public:
+
+    Ingester();
+    Ingester(ConnectionTable& table) : Ingester() { this->addTable(table); }
+    ~Ingester();
+
+    void start();
+    void stop();
+
+    void addTable(ConnectionTable& table);
+
+    // Returns once the ingestion thread no longer uses the table:
+    void removeTable(ConnectionTable& table);
+
+    size_t getTableCount() const { return this->table_count; }
+
+private:
+
+    static constexpr chrono::milliseconds DELTA_INTERVAL{100};
+
+    struct Change
+    {
+        ConnectionTable* table;
+        bool add;
+    };
+
+    struct IntHash
+    {
+        size_t operator()(int value) const { return static_cast<size_t>(value) * 0x9E3779B97F4A7C15ULL; }
+    };
+
+    void run();
+    void wakeUp();
+    void applyChanges();
+    void watch(ConnectionTable& table);
+    void unwatch(ConnectionTable& table);
+
+    // Only touched by the ingestion thread while it runs:
+    vector<ConnectionTable*> tables;
+    FlatHashMap<int, ConnectionTable*, IntHash> fd_tables;
+
+    mutex changes_mutex;
+    condition_variable changes_applied;
+    vector<Change> changes;
+    uint64_t requested_changes = 0;
+    uint64_t applied_changes = 0;
+    atomic<size_t> table_count{0};
+
+    thread worker;
+    int epoll_fd = -1;
+    int wakeup_fd = -1;
+    atomic<bool> running{false};
+};
+
+} // namespace conntrackex
@@ -0,0 +1,207 @@
+#include "local_addresses.h"
+
+#include <cerrno>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <iostream>
+#include <stdexcept>
+
+#include "network_namespace.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+LocalAddressSet::~LocalAddressSet()
+{
+    if (this->netlink_fd >= 0)
+        close(this->netlink_fd);
+}
+
+void LocalAddressSet::load(bool log_debug_messages)
+{
+    // This method inspired by GetNetworkInterfaceInfos() in
+    // https://public.msli.com/lcs/muscle/muscle/util/NetworkUtilityFunctions.cpp
+
+    this->log_debug_messages = log_debug_messages;
+    this->clear();
+
+    NetworkNamespaceSwitch in_namespace(this->namespace_fd);
+    struct ifaddrs* ifap;
+    if (getifaddrs(&ifap) != 0)
+    {
+        cerr << "[WARNING] Can't get local network interface addresses." << endl;
+        return;
+    }
+
+    for (auto current_ifap = ifap; current_ifap; current_ifap = current_ifap->ifa_next)
+    {
+        if (!current_ifap->ifa_addr)
+            continue;
+
+        char address_str[INET6_ADDRSTRLEN] = "";
+        if (current_ifap->ifa_addr->sa_family == AF_INET)
+        {
+            auto address = &((struct sockaddr_in*)current_ifap->ifa_addr)->sin_addr;
+            this->add(address->s_addr);
+            inet_ntop(AF_INET, address, address_str, sizeof(address_str));
+        }
+        else if (current_ifap->ifa_addr->sa_family == AF_INET6)
+        {
+            auto address = &((struct sockaddr_in6*)current_ifap->ifa_addr)->sin6_addr;
+            IPv6Address ipv6_address;
+            memcpy(ipv6_address.bytes, address, sizeof(ipv6_address.bytes));
+            this->add(ipv6_address);
+            inet_ntop(AF_INET6, address, address_str, sizeof(address_str));
+        }
+        else
+            continue;
+
+        if (log_debug_messages)
+            cout << "[DEBUG] Found local IP: '" << address_str << "'" << endl;
+    }
+
+    freeifaddrs(ifap);
+}
+
+void LocalAddressSet::subscribe()
+{
+    NetworkNamespaceSwitch in_namespace(this->namespace_fd);
+    this->netlink_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (this->netlink_fd < 0)
+        throw runtime_error("Unable to open an rtnetlink socket.");
+
+    struct sockaddr_nl address = {};
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+    if (bind(this->netlink_fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+        throw runtime_error("Unable to subscribe to interface address changes.");
+}
+
+bool LocalAddressSet::update(vector<uint32_t>& changed_ipv4_addresses)
+{
+    char buffer[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+
+    while (true)
+    {
+        auto length = recv(this->netlink_fd, buffer, sizeof(buffer), 0);
+        if (length < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != ENOBUFS)
+                return false;
+
+            // Notifications were dropped, so start over from the kernel's view:
+            cerr << "[WARNING] Missed interface address changes, reloading local addresses." << endl;
+            while (recv(this->netlink_fd, buffer, sizeof(buffer), 0) > 0)
+                ;
+            this->load(this->log_debug_messages);
+            return true;
+        }
+
+        for (auto message = (struct nlmsghdr*)buffer; NLMSG_OK(message, length); message = NLMSG_NEXT(message, length))
+        {
+            if (message->nlmsg_type != RTM_NEWADDR && message->nlmsg_type != RTM_DELADDR)
+                continue;
+
+            auto info = (struct ifaddrmsg*)NLMSG_DATA(message);
+            const void* local = nullptr;
+            const void* address = nullptr;
+            int attributes_length = IFA_PAYLOAD(message);
+            for (auto attribute = IFA_RTA(info); RTA_OK(attribute, attributes_length); attribute = RTA_NEXT(attribute, attributes_length))
+            {
+                if (attribute->rta_type == IFA_LOCAL)
+                    local = RTA_DATA(attribute);
+                else if (attribute->rta_type == IFA_ADDRESS)
+                    address = RTA_DATA(attribute);
+            }
+
+            // IFA_ADDRESS is the peer on point-to-point links, IFA_LOCAL ours:
+            if (local)
+                address = local;
+            if (!address)
+                continue;
+
+            bool added = (message->nlmsg_type == RTM_NEWADDR);
+
+            // The same address may still be assigned to another interface:
+            if (!added && this->isAssigned(info->ifa_family, address))
+                continue;
+
+            if (info->ifa_family == AF_INET)
+            {
+                uint32_t ipv4_address;
+                memcpy(&ipv4_address, address, sizeof(ipv4_address));
+                if (added == this->contains(ipv4_address))
+                    continue;
+
+                if (added)
+                    this->add(ipv4_address);
+                else
+                    this->ipv4_addresses.erase(ipv4_address);
+                changed_ipv4_addresses.push_back(ipv4_address);
+            }
+            else if (info->ifa_family == AF_INET6)
+            {
+                IPv6Address ipv6_address;
+                memcpy(ipv6_address.bytes, address, sizeof(ipv6_address.bytes));
+                if (added == this->contains(ipv6_address))
+                    continue;
+
+                if (added)
+                    this->add(ipv6_address);
+                else
+                    this->ipv6_addresses.erase(ipv6_address);
+            }
+            else
+                continue;
+
+            this->version++;
+
+            if (this->log_debug_messages)
+            {
+                char address_str[INET6_ADDRSTRLEN] = "";
+                inet_ntop(info->ifa_family, address, address_str, sizeof(address_str));
+                cout << "[DEBUG] " << (added ? "Added" : "Removed") << " local IP: '" << address_str << "'" << endl;
+            }
+        }
+    }
+}
+
+void LocalAddressSet::clear()
+{
+    this->ipv4_addresses.clear();
+    this->ipv6_addresses.clear();
+    this->version++;
+}
+
+bool LocalAddressSet::isAssigned(int family, const void* address) const
+{
+    NetworkNamespaceSwitch in_namespace(this->namespace_fd);
+    struct ifaddrs* ifap;
+    if (getifaddrs(&ifap) != 0)
+        return false;
+
+    bool assigned = false;
+    for (auto current_ifap = ifap; current_ifap && !assigned; current_ifap = current_ifap->ifa_next)
+    {
+        if (!current_ifap->ifa_addr || current_ifap->ifa_addr->sa_family != family)
+            continue;
+
+        if (family == AF_INET)
+            assigned = memcmp(&((struct sockaddr_in*)current_ifap->ifa_addr)->sin_addr, address, sizeof(struct in_addr)) == 0;
+        else
+            assigned = memcmp(&((struct sockaddr_in6*)current_ifap->ifa_addr)->sin6_addr, address, sizeof(struct in6_addr)) == 0;
+    }
+
+    freeifaddrs(ifap);
+    return assigned;
+}
+
+} // namespace conntrackex
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstring>
+#include <vector>
+#include <netinet/in.h>
+
+#include "flat_hash_map.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+struct IPv6Address
+{
+    uint8_t bytes[16];
+
+    bool operator==(const IPv6Address& other) const { return memcmp(this->bytes, other.bytes, sizeof(this->bytes)) == 0; }
+};
+
+struct IPv4AddressHash
+{
+    size_t operator()(uint32_t address) const
+    {
+        uint64_t hash = address * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(hash ^ (hash >> 32));
+    }
+};
+
+struct IPv6AddressHash
+{
+    size_t operator()(const IPv6Address& address) const
+    {
+        uint64_t words[2];
+        memcpy(words, address.bytes, sizeof(words));
+        uint64_t hash = words[0] ^ (words[1] * 0x9E3779B97F4A7C15ULL);
+        return static_cast<size_t>(hash ^ (hash >> 29));
+    }
+};
+
+// The addresses assigned to this host's interfaces, kept as binary hash sets.
+// After subscribe(), RTM_NEWADDR/RTM_DELADDR notifications keep the set up
+// to date as addresses (e.g. VIPs) come and go. Subscribe before load(), so
+// nothing changes unseen in between; adding an address the set already has,
+// or removing one it doesn't, changes nothing.
+class LocalAddressSet
+{
+public:
+
+    LocalAddressSet() {}
+    LocalAddressSet(const LocalAddressSet&) = delete;
+    LocalAddressSet& operator=(const LocalAddressSet&) = delete;
+    ~LocalAddressSet();
+
+    // The network namespace to read addresses from (the caller's by default);
+    // the fd must stay open for as long as the set is in use:
+    void setNetworkNamespace(int namespace_fd) { this->namespace_fd = namespace_fd; }
+
+    void load(bool log_debug_messages = false);
+    void subscribe();
+    int getFileDescriptor() const { return this->netlink_fd; }
+
+    // Applies queued address notifications and reports the IPv4 addresses
+    // that were added or removed. Returns true if notifications were lost and
+    // the whole set had to be reloaded instead.
+    bool update(vector<uint32_t>& changed_ipv4_addresses);
+
+    // Changes whenever an address of either family is added or removed:
+    uint64_t getVersion() const { return this->version; }
+
+    // Addresses are in network byte order:
+    bool contains(uint32_t ipv4_address) const { return this->ipv4_addresses.find(ipv4_address) != nullptr; }
+    bool contains(const IPv6Address& ipv6_address) const { return this->ipv6_addresses.find(ipv6_address) != nullptr; }
+    void add(uint32_t ipv4_address) { this->ipv4_addresses.insert(ipv4_address, true); }
+    void add(const IPv6Address& ipv6_address) { this->ipv6_addresses.insert(ipv6_address, true); }
+    void clear();
+
+    const FlatHashMap<uint32_t, bool, IPv4AddressHash>& getIPv4Addresses() const { return this->ipv4_addresses; }
+    const FlatHashMap<IPv6Address, bool, IPv6AddressHash>& getIPv6Addresses() const { return this->ipv6_addresses; }
+
+private:
+
+    bool isAssigned(int family, const void* address) const;
+
+    FlatHashMap<uint32_t, bool, IPv4AddressHash> ipv4_addresses;
+    FlatHashMap<IPv6Address, bool, IPv6AddressHash> ipv6_addresses;
+    int netlink_fd = -1;
+    int namespace_fd = -1;
+    bool log_debug_messages = false;
+    uint64_t version = 0;
+};
+
+} // namespace conntrackex
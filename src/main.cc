@@ -1,3 +1,4 @@
+#include <list>
 #include <string>
 #include <thread>
 #include <signal.h>
@@ -5,11 +6,12 @@
 
 #include <argagg/argagg.hpp>
 
-#include <prometheus/exposer.h>
-#include <prometheus/registry.h>
-#include <prometheus/gauge.h>
-
 #include "connection_table.h"
+#include "connection_metrics.h"
+#include "host_delta_handler.h"
+#include "ingester.h"
+#include "metrics_server.h"
+#include "namespace_monitor.h"
 
 using namespace std;
 using namespace conntrackex;
@@ -50,6 +52,7 @@ void tokenize(const std::string& str,
 
 int main(int argc, char** argv)
 {
+    auto started_at = chrono::steady_clock::now();
     signal(SIGINT, sigint_handler);
     using namespace prometheus;
 
@@ -59,9 +62,29 @@ int main(int argc, char** argv)
         { "bind_address", {"-b", "--bind-address"}, "The IP address on which to bind the metrics HTTP endpoint (default: 0.0.0.0)", 1 },
         { "listen_port", {"-l", "--listen-port"}, "The port on which to expose the metrics HTTP endpoint (default: 9318)", 1 },
         { "listen_path", {"-p", "--listen-path"}, "The path on which to expose the metrics HTTP endpoint (default: /metrics)", 1 },
-        { "ignore_hosts", {"-i", "--ignore-hosts"}, "Comma-separated list of hosts to ignore", 1 },
+        { "ignore_hosts", {"-i", "--ignore-hosts"}, "Comma-separated list of hosts to ignore (ip, ip:port, cidr or cidr:port)", 1 },
+        { "netlink_buffer_size", {"-r", "--netlink-buffer-size"}, "Receive buffer size in bytes for the conntrack event socket (default: system default)", 1 },
+        { "event_groups", {"--event-groups"}, "Which conntrack events to process: all [default], new-destroy (connections count as open until destroyed) or transitions (only updates that move a connection between the exported states)", 1 },
+        { "resync_interval", {"--resync-interval"}, "Reconcile the connection table against a full dump every this many seconds, e.g. to catch events the reduced event groups skip (default: 0, never)", 1 },
+        { "connection_memory_limit", {"--connection-memory-limit"}, "Limit the memory used by connection table entries to this many bytes, shedding connections that are still opening first once it's reached; per-host state isn't counted (default: no limit)", 1 },
+        { "host_totals_expiry", {"--host-totals-expiry"}, "Drop a remote host's duration histograms and traffic counters once it has had no connections and nothing new to count for this many seconds (default: 300, 0 keeps them for good)", 1 },
+        { "host_prefix_length", {"--host-prefix-length"}, "Aggregate remote hosts into IPv4 networks of this prefix length (default: 32)", 1 },
+        { "drop_ephemeral_ports", {"--drop-ephemeral-ports"}, "Leave the port out of the host label for inbound connections, whose remote port is ephemeral", 0 },
+        { "top_hosts", {"--top-hosts"}, "Export only the K remote hosts with the most new connections separately and count the rest as host=\"other\" (default: no limit)", 1 },
         { "log_events", {"-e", "--log-events"}, "Enables logging of connection events", 0 },
         { "log_events_format", {"-f", "--log-events-format"}, "Connection events log format (netfilter [default] or json)", 1 },
+        { "log_events_file", {"--log-events-file"}, "Write connection events to this file instead of stdout", 1 },
+        { "log_events_max_file_size", {"--log-events-max-file-size"}, "Rotate the connection events log file to <file>.1 once it reaches this many bytes (default: no rotation)", 1 },
+        { "log_events_socket", {"--log-events-socket"}, "Send connection events as datagrams to this unix socket instead of stdout", 1 },
+        { "min_refresh_interval", {"--min-refresh-interval"}, "Minimum time in milliseconds between refreshes of the metrics; scrapes in between get the previous data (default: 0)", 1 },
+        { "record_events", {"--record-events"}, "Record the raw conntrack messages received to this file, for --replay-events", 1 },
+        { "replay_events", {"--replay-events"}, "Replay a recording made with --record-events instead of watching the system's connections", 1 },
+        { "replay_original_pacing", {"--replay-original-pacing"}, "Replay at the pace the events were recorded at instead of as fast as possible", 0 },
+        { "netns", {"--netns"}, "Also monitor the connections of every other network namespace on the host, labelled by namespace", 0 },
+        { "netns_workers", {"--netns-workers"}, "How many threads to process other network namespaces' events on (default: 2)", 1 },
+        { "netns_rescan_interval", {"--netns-rescan-interval"}, "How often in seconds to look for network namespaces being created or removed (default: 30)", 1 },
+        { "delta_path", {"--delta-path"}, "The path on which to serve the per-host counts of the exporter's own network namespace changed since a given generation, as JSON (default: <listen path>/delta)", 1 },
+        { "delta_log_size", {"--delta-log-size"}, "How many host changes to keep for the delta endpoint; clients further behind get the full state (default: 65536, 0 disables the endpoint)", 1 },
         { "debug", {"-d", "--debug"}, "Enables logging of debug messages", 0 },
         { "help", {"-h", "--help"}, "Print help and exit", 0 },
 
@@ -102,89 +125,156 @@ int main(int argc, char** argv)
     const string listen_path = args["listen_path"] ?
 	args["listen_path"].as<std::string>() :
 	"/metrics"; 
+    const string delta_path = args["delta_path"] ?
+        args["delta_path"].as<std::string>() :
+        listen_path + "/delta";
+    const size_t delta_log_size = args["delta_log_size"].as<size_t>(65536);
 
     try
     {
         cout << "conntrack_exporter v0.3.1" << endl;
 
-        Exposer exposer{bind_address + ":" + listen_port};
-        cout << "Serving metrics at http://" + guessed_local_endpoint + ":" << listen_port << listen_path + " ..." << endl;
-
-        ConnectionTable table;
-        if (args["log_events"])
-            table.enableLogging();
+        // Events are logged from a writer thread of their own:
+        EventLog event_log;
         if (args["log_events_format"])
-            table.setLoggingFormat(args["log_events_format"]);
-        if (args["debug"])
-            table.enableDebugging();
+            event_log.setFormat(args["log_events_format"].as<std::string>());
+        if (args["log_events_file"])
+            event_log.setFile(
+                args["log_events_file"].as<std::string>(),
+                args["log_events_max_file_size"].as<size_t>(0));
+        if (args["log_events_socket"])
+            event_log.setSocket(args["log_events_socket"].as<std::string>());
+
+        EventRecorder event_recorder;
+        if (args["record_events"])
+            event_recorder.open(args["record_events"].as<std::string>());
+
+        // Remote hosts are aggregated the same way in every table, and the
+        // top hosts are picked across all of them:
+        HostAggregator host_aggregator;
+        if (args["host_prefix_length"])
+            host_aggregator.setPrefixLength(args["host_prefix_length"].as<unsigned int>());
+        if (args["drop_ephemeral_ports"])
+            host_aggregator.setDropEphemeralPorts();
+        if (args["top_hosts"])
+            host_aggregator.setTopHosts(args["top_hosts"].as<unsigned int>());
+        if (args["netns"])
+            host_aggregator.setMultipleTables(true);
+
+        list<string> ignored_hosts;
         if (args["ignore_hosts"])
-        {
-            list<string> ignored_hosts;
             tokenize(args["ignore_hosts"], ignored_hosts, ", \t", true);
+
+        // Every table, whichever network namespace it watches, is set up the
+        // same way:
+        auto configure_table = [&](ConnectionTable& table)
+        {
+            if (args["log_events"])
+                table.setEventLog(&event_log);
+            if (args["debug"])
+                table.enableDebugging();
+            if (args["netlink_buffer_size"])
+                table.setReceiveBufferSize(args["netlink_buffer_size"].as<int>());
+            if (args["event_groups"])
+                table.setEventGroups(args["event_groups"].as<std::string>());
+            if (args["resync_interval"])
+                table.setResyncInterval(args["resync_interval"].as<unsigned int>());
+            if (args["host_totals_expiry"])
+                table.setHostTotalsExpiry(args["host_totals_expiry"].as<unsigned int>());
+            if (args["connection_memory_limit"])
+                table.setMemoryLimit(args["connection_memory_limit"].as<size_t>());
+            table.setHostAggregator(&host_aggregator);
             for (auto& host : ignored_hosts)
-            {
                 table.addIgnoredHost(host);
+        };
 
-                if (args["debug"])
-                    cout << "[DEBUG] Added to ignored host list: '" << host << "'" << endl;
-            }
+        ConnectionTable table;
+        if (args["record_events"])
+            table.setEventRecorder(&event_recorder);
+        configure_table(table);
+        if (delta_log_size > 0)
+            table.enableDeltaLog(delta_log_size);
+        if (args["debug"])
+        {
+            for (auto& host : ignored_hosts)
+                cout << "[DEBUG] Added to ignored host list: '" << host << "'" << endl;
+        }
+        if (args["log_events"])
+        {
+            if (args["netns"])
+                event_log.setMultipleProducers(true);
+            event_log.start();
         }
 
-        Connection::loadLocalIPAddresses(args["debug"]);
+        NamespaceMonitor namespace_monitor(configure_table);
+        if (args["netns_workers"])
+            namespace_monitor.setWorkerCount(args["netns_workers"].as<size_t>());
+        if (args["netns_rescan_interval"])
+            namespace_monitor.setRescanInterval(chrono::seconds(args["netns_rescan_interval"].as<unsigned int>()));
 
-        table.attach();
-        while (keep_running) {
-
-            // Build up a registry and metric families:
-            auto registry = std::make_shared<Registry>();
-            auto& opening_connections_family = BuildGauge()
-                .Name("conntrack_opening_connections")
-                .Help("How many connections to the remote host are currently opening?")
-                .Register(*registry);
-            auto& open_connections_family = BuildGauge()
-                .Name("conntrack_open_connections")
-                .Help("How many open connections are there to the remote host?")
-                .Register(*registry);
-            auto& closing_connections_family = BuildGauge()
-                .Name("conntrack_closing_connections")
-                .Help("How many connections to the remote host are currently closing?")
-                .Register(*registry);
-            auto& closed_connections_family = BuildGauge()
-                .Name("conntrack_closed_connections")
-                .Help("How many connections to the remote host have recently closed?")
-                .Register(*registry);
-
-            // Add guages for the individual connections:
-            table.update();
-            for (auto& connection : table.getConnections())
-            {
-                if (!connection.hasState())
-                    continue;
+        // Metrics are computed from the table when a scrape arrives, and the
+        // rendered page is only rebuilt once the table has changed:
+        auto metrics = std::make_shared<ConnectionMetrics>(table);
+        if (args["min_refresh_interval"])
+            metrics->setMinRefreshInterval(chrono::milliseconds(args["min_refresh_interval"].as<unsigned int>()));
+        if (args["netns"])
+            metrics->setNamespaceMonitor(&namespace_monitor);
+        // Declared first so the server stops before it goes away:
+        HostDeltaHandler delta_handler(table, MetricsServer::getThreadCount() / 2);
+        MetricsServer server(bind_address + ":" + listen_port, listen_path, [metrics]() { return metrics->getGeneration(); });
+        server.registerCollectable(metrics);
+        cout << "Serving metrics at http://" + guessed_local_endpoint + ":" << listen_port << listen_path + " ..." << endl;
+        if (delta_log_size > 0)
+        {
+            server.addHandler(delta_path, &delta_handler);
+            cout << "Serving host deltas at http://" + guessed_local_endpoint + ":" << listen_port << delta_path + " ..." << endl;
+        }
+
+        if (args["replay_events"])
+        {
+            // Replays don't touch the system's connection table, and the
+            // resulting metrics stay up until Ctrl+C so they can be checked:
+            EventReplayer replayer;
+            replayer.open(args["replay_events"].as<std::string>());
+            if (args["replay_original_pacing"])
+                replayer.setOriginalPacing();
 
-                Gauge* pGauge;
-                switch (connection.getState())
+            auto start = chrono::steady_clock::now();
+            auto next_snapshot = start;
+            while (keep_running && replayer.replayNext(table))
+            {
+                auto now = chrono::steady_clock::now();
+                if (now >= next_snapshot)
                 {
-                    case ConnectionState::OPENING:
-                        pGauge = &opening_connections_family.Add({{"host", connection.getRemoteHost()}});
-                        break;
-                    case ConnectionState::OPEN:
-                        pGauge = &open_connections_family.Add({{"host", connection.getRemoteHost()}});
-                        break;
-                    case ConnectionState::CLOSING:
-                        pGauge = &closing_connections_family.Add({{"host", connection.getRemoteHost()}});
-                        break;
-                    case ConnectionState::CLOSED:
-                        pGauge = &closed_connections_family.Add({{"host", connection.getRemoteHost()}});
-                        break;
-                    default:
-                        continue;
+                    table.publishSnapshot();
+                    next_snapshot = now + chrono::milliseconds(100);
                 }
-                pGauge->Increment();
             }
-            exposer.RegisterCollectable(registry, listen_path);
+            table.publishSnapshot();
 
-            this_thread::sleep_for(chrono::seconds(1));
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "Replayed " << replayer.getEventCount() << " events in " << seconds << " s ("
+                 << replayer.getEventCount() / seconds << " events/s)" << endl;
+
+            while (keep_running)
+                this_thread::sleep_for(chrono::milliseconds(200));
+            return EXIT_SUCCESS;
         }
+
+        // Events are drained on their own thread and scrapes are served by
+        // the server's, so all that's left here is to wait for Ctrl+C:
+        table.attach();
+        Ingester ingester(table);
+        ingester.start();
+
+        auto stats = table.getSnapshot()->stats;
+        cout << "Loaded " << stats.rebuild_connections << " connections in " << stats.rebuild_seconds << " s, "
+             << "serving their metrics " << chrono::duration<double>(chrono::steady_clock::now() - started_at).count()
+             << " s after startup" << endl;
+        if (args["netns"])
+            namespace_monitor.start();
+        while (keep_running)
+            this_thread::sleep_for(chrono::milliseconds(200));
     }
     catch (const exception& e)
     {
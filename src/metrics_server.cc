@@ -0,0 +1,122 @@
+#include "metrics_server.h"
+
+#include <cstring>
+#include <zlib.h>
+#include <civetweb.h>
+#include <prometheus/metric_family.h>
+#include <prometheus/text_serializer.h>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+MetricsServer::MetricsServer(const string& bind_address, const string& path, function<uint64_t()> get_generation) :
+    path(path),
+    get_generation(get_generation)
+{
+    this->server.reset(new CivetServer({
+        "listening_ports", bind_address,
+        "num_threads", to_string(getThreadCount())
+    }));
+    this->server->addHandler(this->path, this);
+}
+
+void MetricsServer::addHandler(const string& path, CivetHandler* handler)
+{
+    this->server->addHandler(path, handler);
+}
+
+MetricsServer::~MetricsServer()
+{
+    // Stop serving before the rest of the server goes away:
+    this->server.reset();
+}
+
+void MetricsServer::registerCollectable(const shared_ptr<prometheus::Collectable>& collectable)
+{
+    lock_guard<mutex> lock(this->render_mutex);
+    this->collectables.push_back(collectable);
+    atomic_store(&this->exposition, shared_ptr<const Exposition>());
+}
+
+bool MetricsServer::handleGet(CivetServer* /*server*/, struct mg_connection* connection)
+{
+    auto exposition = this->getExposition();
+
+    const char* accept_encoding = mg_get_header(connection, "Accept-Encoding");
+    bool use_gzip = accept_encoding && strstr(accept_encoding, "gzip") && !exposition->gzip.empty();
+    auto& body = use_gzip ? exposition->gzip : exposition->text;
+
+    mg_printf(connection,
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Vary: Accept-Encoding\r\n"
+        "%s"
+        "Content-Length: %zu\r\n"
+        "\r\n",
+        use_gzip ? "Content-Encoding: gzip\r\n" : "",
+        body.size());
+    mg_write(connection, body.data(), body.size());
+
+    return true;
+}
+
+shared_ptr<const MetricsServer::Exposition> MetricsServer::getExposition()
+{
+    uint64_t generation = this->get_generation();
+
+    auto exposition = atomic_load(&this->exposition);
+    if (exposition && exposition->generation == generation)
+        return exposition;
+
+    // Only one scraper renders a new generation; the others wait for it and
+    // then share the result:
+    lock_guard<mutex> lock(this->render_mutex);
+    exposition = atomic_load(&this->exposition);
+    if (exposition && exposition->generation == generation)
+        return exposition;
+
+    exposition = this->render(generation);
+    atomic_store(&this->exposition, exposition);
+    return exposition;
+}
+
+shared_ptr<const MetricsServer::Exposition> MetricsServer::render(uint64_t generation)
+{
+    vector<prometheus::MetricFamily> families;
+    for (auto& collectable : this->collectables)
+    {
+        auto collected = collectable->Collect();
+        families.insert(families.end(), make_move_iterator(collected.begin()), make_move_iterator(collected.end()));
+    }
+
+    auto exposition = make_shared<Exposition>();
+    exposition->generation = generation;
+    exposition->text = prometheus::TextSerializer().Serialize(families);
+    exposition->gzip = compress(exposition->text);
+    return exposition;
+}
+
+string MetricsServer::compress(const string& text)
+{
+    z_stream stream = {};
+    // 15 window bits plus 16 selects the gzip wrapper:
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return string();
+
+    string output(deflateBound(&stream, text.size()), '\0');
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+    stream.avail_in = text.size();
+    stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+    stream.avail_out = output.size();
+
+    int result = deflate(&stream, Z_FINISH);
+    output.resize(stream.total_out);
+    deflateEnd(&stream);
+
+    // An empty result makes the server fall back to the uncompressed text:
+    return (result == Z_STREAM_END) ? output : string();
+}
+
+} // namespace conntrackex
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <CivetServer.h>
+#include <prometheus/collectable.h>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// Serves the metrics endpoint. The exposition text, and a gzip copy of it,
+// are rendered once per generation of the exported state and then served
+// as-is to every scraper until the generation moves, so concurrent or
+// repeated scrapes of an unchanged state cost no more than a copy.
+class MetricsServer : public CivetHandler
+{
+public:
+
+    // get_generation returns a number that changes whenever the registered
+    // collectables would report something different:
+    MetricsServer(const string& bind_address, const string& path, function<uint64_t()> get_generation);
+    ~MetricsServer();
+
+    // How many requests the server handles at once:
+    static unsigned getThreadCount() { return 8; }
+
+    void registerCollectable(const shared_ptr<prometheus::Collectable>& collectable);
+
+    // Serves another path from the same server. The handler must outlive it:
+    void addHandler(const string& path, CivetHandler* handler);
+
+    bool handleGet(CivetServer* server, struct mg_connection* connection) override;
+
+private:
+
+    struct Exposition
+    {
+        uint64_t generation = 0;
+        string text;
+        string gzip;
+    };
+
+    shared_ptr<const Exposition> getExposition();
+    shared_ptr<const Exposition> render(uint64_t generation);
+    static string compress(const string& text);
+
+    string path;
+    function<uint64_t()> get_generation;
+    vector<shared_ptr<prometheus::Collectable>> collectables;
+    mutex render_mutex;
+    shared_ptr<const Exposition> exposition;
+    unique_ptr<CivetServer> server;
+};
+
+} // namespace conntrackex
@@ -0,0 +1,170 @@
+#include "namespace_monitor.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+NamespaceMonitor::~NamespaceMonitor()
+{
+    this->stop();
+}
+
+void NamespaceMonitor::start()
+{
+    for (size_t i = 0; i < max<size_t>(this->worker_count, 1); i++)
+    {
+        this->ingesters.emplace_back(new Ingester());
+        this->ingesters.back()->start();
+    }
+
+    // Namespaces that exist at startup are in the first scrape:
+    this->rescan();
+
+    this->running = true;
+    this->scanner = thread(&NamespaceMonitor::run, this);
+}
+
+void NamespaceMonitor::stop()
+{
+    {
+        lock_guard<mutex> lock(this->scanner_mutex);
+        if (!this->running)
+            return;
+        this->running = false;
+    }
+    this->scanner_wakeup.notify_all();
+    this->scanner.join();
+
+    for (auto& ingester : this->ingesters)
+        ingester->stop();
+
+    while (!this->namespaces.empty())
+    {
+        unique_ptr<MonitoredNamespace> monitored;
+        {
+            lock_guard<mutex> lock(this->namespaces_mutex);
+            monitored = move(this->namespaces.begin()->second);
+            this->namespaces.erase(this->namespaces.begin());
+        }
+        this->remove(move(monitored));
+    }
+}
+
+vector<NamespaceMonitor::Source> NamespaceMonitor::getSnapshots(chrono::milliseconds timeout) const
+{
+    lock_guard<mutex> lock(this->namespaces_mutex);
+
+    // Ask every table first, so their ingesters build the snapshots in
+    // parallel:
+    vector<uint64_t> requests;
+    requests.reserve(this->namespaces.size());
+    for (auto& entry : this->namespaces)
+        requests.push_back(entry.second->table->requestSnapshot());
+
+    auto deadline = chrono::steady_clock::now() + timeout;
+    vector<Source> sources;
+    sources.reserve(this->namespaces.size());
+    for (auto& entry : this->namespaces)
+    {
+        auto remaining = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+        auto snapshot = entry.second->table->waitForSnapshot(requests[sources.size()], max(remaining, chrono::milliseconds(0)));
+        sources.push_back({entry.second->network_namespace.name, snapshot});
+    }
+    return sources;
+}
+
+void NamespaceMonitor::run()
+{
+    unique_lock<mutex> lock(this->scanner_mutex);
+    while (!this->scanner_wakeup.wait_for(lock, this->rescan_interval, [this]() { return !this->running; }))
+    {
+        lock.unlock();
+        this->rescan();
+        lock.lock();
+    }
+}
+
+void NamespaceMonitor::rescan()
+{
+    auto discovered = NetworkNamespace::discover();
+
+    // Drop the tables of namespaces that are gone:
+    vector<unique_ptr<MonitoredNamespace>> vanished;
+    {
+        lock_guard<mutex> lock(this->namespaces_mutex);
+        for (auto entry = this->namespaces.begin(); entry != this->namespaces.end(); )
+        {
+            bool exists = any_of(discovered.begin(), discovered.end(),
+                [&](const NetworkNamespace& network_namespace) { return network_namespace.inode == entry->first; });
+            if (exists)
+            {
+                ++entry;
+                continue;
+            }
+
+            vanished.push_back(move(entry->second));
+            entry = this->namespaces.erase(entry);
+        }
+    }
+    for (auto& monitored : vanished)
+        this->remove(move(monitored));
+
+    for (auto& network_namespace : discovered)
+    {
+        if (!this->namespaces.count(network_namespace.inode))
+            this->add(network_namespace);
+    }
+}
+
+void NamespaceMonitor::add(const NetworkNamespace& network_namespace)
+{
+    unique_ptr<MonitoredNamespace> monitored(new MonitoredNamespace());
+    monitored->network_namespace = network_namespace;
+    monitored->fd = network_namespace.open();
+    if (monitored->fd < 0)
+        return;
+
+    monitored->table.reset(new ConnectionTable());
+    this->configure_table(*monitored->table);
+    monitored->table->setNetworkNamespace(monitored->fd);
+    try
+    {
+        monitored->table->attach();
+    }
+    catch (const exception& e)
+    {
+        cerr << "[WARNING] Can't monitor network namespace " << network_namespace.name << ": " << e.what() << endl;
+        monitored->table.reset();
+        close(monitored->fd);
+        return;
+    }
+
+    // Hand the table to the least busy ingestion thread:
+    auto ingester = min_element(this->ingesters.begin(), this->ingesters.end(),
+        [](const unique_ptr<Ingester>& a, const unique_ptr<Ingester>& b) { return a->getTableCount() < b->getTableCount(); });
+    monitored->ingester = ingester->get();
+    monitored->ingester->addTable(*monitored->table);
+
+    cout << "Monitoring network namespace " << network_namespace.name << endl;
+
+    lock_guard<mutex> lock(this->namespaces_mutex);
+    this->namespaces[network_namespace.inode] = move(monitored);
+    this->version++;
+}
+
+void NamespaceMonitor::remove(unique_ptr<MonitoredNamespace> monitored)
+{
+    cout << "Stopped monitoring network namespace " << monitored->network_namespace.name << endl;
+
+    monitored->ingester->removeTable(*monitored->table);
+    monitored->table.reset();
+    close(monitored->fd);
+    this->version++;
+}
+
+} // namespace conntrackex
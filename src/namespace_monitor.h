@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "connection_table.h"
+#include "ingester.h"
+#include "network_namespace.h"
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// Tracks the connections of every other network namespace on the host (e.g.
+// each pod's on a Kubernetes node) with a table per namespace. The tables are
+// spread over a small, fixed pool of ingestion threads rather than getting a
+// thread each, and namespaces are picked up and dropped as they come and go.
+class NamespaceMonitor
+{
+public:
+
+    struct Source
+    {
+        string name;
+        shared_ptr<const TableSnapshot> snapshot;
+    };
+
+    // configure_table is applied to every new table before it's attached:
+    NamespaceMonitor(function<void(ConnectionTable&)> configure_table) : configure_table(configure_table) {}
+    ~NamespaceMonitor();
+
+    void setWorkerCount(size_t worker_count) { this->worker_count = worker_count; }
+    void setRescanInterval(chrono::seconds interval) { this->rescan_interval = interval; }
+
+    void start();
+    void stop();
+
+    // A snapshot of each monitored namespace's table as of the call, or the
+    // latest one of a table whose ingester doesn't get to it in time:
+    vector<Source> getSnapshots(chrono::milliseconds timeout) const;
+
+    // Changes whenever a namespace is added or removed:
+    uint64_t getVersion() const { return this->version; }
+
+private:
+
+    struct MonitoredNamespace
+    {
+        NetworkNamespace network_namespace;
+        int fd = -1;
+        unique_ptr<ConnectionTable> table;
+        Ingester* ingester = nullptr;
+    };
+
+    void run();
+    void rescan();
+    void add(const NetworkNamespace& network_namespace);
+    void remove(unique_ptr<MonitoredNamespace> monitored);
+
+    function<void(ConnectionTable&)> configure_table;
+    size_t worker_count = 2;
+    chrono::seconds rescan_interval{30};
+
+    vector<unique_ptr<Ingester>> ingesters;
+
+    // Keyed by inode; only the rescan thread adds and removes entries:
+    map<uint64_t, unique_ptr<MonitoredNamespace>> namespaces;
+    mutable mutex namespaces_mutex;
+    atomic<uint64_t> version{0};
+
+    thread scanner;
+    mutex scanner_mutex;
+    condition_variable scanner_wakeup;
+    bool running = false;
+};
+
+} // namespace conntrackex
@@ -0,0 +1,132 @@
+#include "network_namespace.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cctype>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_set>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+namespace {
+
+bool getInode(const string& path, uint64_t& inode)
+{
+    struct stat file_stat;
+    if (stat(path.c_str(), &file_stat) != 0)
+        return false;
+
+    inode = file_stat.st_ino;
+    return true;
+}
+
+template <class Callback>
+void forEachDirectoryEntry(const char* path, Callback callback)
+{
+    auto directory = opendir(path);
+    if (!directory)
+        return;
+
+    while (auto entry = readdir(directory))
+    {
+        if (entry->d_name[0] != '.')
+            callback(string(entry->d_name));
+    }
+    closedir(directory);
+}
+
+} // namespace
+
+vector<NetworkNamespace> NetworkNamespace::discover()
+{
+    vector<NetworkNamespace> namespaces;
+    unordered_set<uint64_t> seen_inodes;
+
+    // Our own namespace is watched by the main connection table:
+    uint64_t own_inode;
+    if (getInode("/proc/self/ns/net", own_inode))
+        seen_inodes.insert(own_inode);
+
+    // Named namespaces come first so they keep their names:
+    forEachDirectoryEntry("/var/run/netns", [&](const string& name)
+    {
+        NetworkNamespace ns;
+        ns.name = name;
+        ns.path = "/var/run/netns/" + name;
+        if (getInode(ns.path, ns.inode) && seen_inodes.insert(ns.inode).second)
+            namespaces.push_back(ns);
+    });
+
+    forEachDirectoryEntry("/proc", [&](const string& pid)
+    {
+        if (!isdigit(pid[0]))
+            return;
+
+        NetworkNamespace ns;
+        ns.path = "/proc/" + pid + "/ns/net";
+        if (!getInode(ns.path, ns.inode) || !seen_inodes.insert(ns.inode).second)
+            return;
+
+        ns.name = "net:[" + to_string(ns.inode) + "]";
+        namespaces.push_back(ns);
+    });
+
+    return namespaces;
+}
+
+int NetworkNamespace::open() const
+{
+    int fd = ::open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    // The process may have exited and its pid been reused since discovery:
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_ino != this->inode)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+NetworkNamespaceSwitch::NetworkNamespaceSwitch(int namespace_fd)
+{
+    if (namespace_fd < 0)
+        return;
+
+    // setns() moves just the calling thread, so remember where this thread
+    // (not the whole process) was:
+    this->original_fd = ::open("/proc/thread-self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (this->original_fd < 0)
+        throw runtime_error("Unable to open the current network namespace.");
+
+    if (setns(namespace_fd, CLONE_NEWNET) != 0)
+    {
+        close(this->original_fd);
+        throw runtime_error("Unable to enter a network namespace. (Does the current user have sufficient privileges?)");
+    }
+}
+
+NetworkNamespaceSwitch::~NetworkNamespaceSwitch()
+{
+    if (this->original_fd < 0)
+        return;
+
+    if (setns(this->original_fd, CLONE_NEWNET) != 0)
+    {
+        // Carrying on in the wrong namespace would silently mix up tables:
+        cerr << "ERROR: Unable to return to the original network namespace." << endl;
+        abort();
+    }
+    close(this->original_fd);
+}
+
+} // namespace conntrackex
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// A network namespace on this host other than the exporter's own.
+struct NetworkNamespace
+{
+    string name;        // the name under /var/run/netns, or "net:[<inode>]"
+    string path;        // a file that opens the namespace
+    uint64_t inode = 0; // identifies the namespace for as long as it exists
+
+    // Finds the named namespaces under /var/run/netns and those of running
+    // processes, each once:
+    static vector<NetworkNamespace> discover();
+
+    // Returns a file descriptor for setns(), or -1 if the namespace is gone:
+    int open() const;
+};
+
+// Moves the calling thread into a network namespace until it goes out of
+// scope. A namespace fd of -1 leaves the thread where it is. Sockets opened
+// meanwhile stay in that namespace for good.
+class NetworkNamespaceSwitch
+{
+public:
+
+    NetworkNamespaceSwitch(int namespace_fd);
+    ~NetworkNamespaceSwitch();
+
+    NetworkNamespaceSwitch(const NetworkNamespaceSwitch&) = delete;
+    NetworkNamespaceSwitch& operator=(const NetworkNamespaceSwitch&) = delete;
+
+private:
+
+    int original_fd = -1;
+};
+
+} // namespace conntrackex
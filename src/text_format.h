@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <arpa/inet.h>
+
+
+namespace conntrackex {
+
+using namespace std;
+
+// Allocation-free text formatting for hot paths. Each function writes at
+// the given position in a caller-supplied buffer, which must have room for
+// the longest possible output, and returns the position just past it.
+
+// The longest outputs, not counting a terminating null:
+const size_t MAX_UINT64_LENGTH = 20;
+const size_t MAX_IPV4_LENGTH = 15;
+const size_t MAX_ENDPOINT_LENGTH = MAX_IPV4_LENGTH + 1 + 5;
+
+namespace detail {
+
+const char DIGIT_PAIRS[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+} // namespace detail
+
+inline char* formatString(char* output, const char* text, size_t length)
+{
+    memcpy(output, text, length);
+    return output + length;
+}
+
+// For string literals, whose length is known at compile time:
+template <size_t N>
+inline char* formatLiteral(char* output, const char (&text)[N])
+{
+    return formatString(output, text, N - 1);
+}
+
+inline char* formatUInt(char* output, uint64_t value)
+{
+    // Digits are produced two at a time from the end of a scratch buffer:
+    char digits[MAX_UINT64_LENGTH];
+    char* start = digits + sizeof(digits);
+    while (value >= 100)
+    {
+        unsigned pair = static_cast<unsigned>(value % 100) * 2;
+        value /= 100;
+        *--start = detail::DIGIT_PAIRS[pair + 1];
+        *--start = detail::DIGIT_PAIRS[pair];
+    }
+    if (value >= 10)
+    {
+        unsigned pair = static_cast<unsigned>(value) * 2;
+        *--start = detail::DIGIT_PAIRS[pair + 1];
+        *--start = detail::DIGIT_PAIRS[pair];
+    }
+    else
+        *--start = static_cast<char>('0' + value);
+
+    return formatString(output, start, digits + sizeof(digits) - start);
+}
+
+// Dotted-quad notation of an address in network byte order:
+inline char* formatIPv4(char* output, uint32_t ip)
+{
+    const uint8_t* octets = reinterpret_cast<const uint8_t*>(&ip);
+    for (int i = 0; i < 4; i++)
+    {
+        if (i)
+            *output++ = '.';
+
+        unsigned octet = octets[i];
+        if (octet >= 100)
+        {
+            *output++ = static_cast<char>('0' + octet / 100);
+            octet %= 100;
+            *output++ = detail::DIGIT_PAIRS[octet * 2];
+            *output++ = detail::DIGIT_PAIRS[octet * 2 + 1];
+        }
+        else if (octet >= 10)
+        {
+            *output++ = detail::DIGIT_PAIRS[octet * 2];
+            *output++ = detail::DIGIT_PAIRS[octet * 2 + 1];
+        }
+        else
+            *output++ = static_cast<char>('0' + octet);
+    }
+    return output;
+}
+
+// "ip:port", with both in network byte order:
+inline char* formatEndpoint(char* output, uint32_t ip, uint16_t port)
+{
+    output = formatIPv4(output, ip);
+    *output++ = ':';
+    return formatUInt(output, ntohs(port));
+}
+
+} // namespace conntrackex
@@ -0,0 +1,255 @@
+// Drives ConnectionTable with random NEW/UPDATE/DESTROY sequences through
+// processEvent() and checks the table and its per-host counts against a
+// plain list of connections, looked up by their tuples the way the table
+// used to, after every event. Needs no privileges: events are built with
+// nfct_new()/nfct_set_attr*() and fed to the table directly.
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <iostream>
+#include <list>
+#include <map>
+#include <random>
+#include <string>
+#include <tuple>
+
+#include "connection_table.h"
+
+using namespace std;
+using namespace conntrackex;
+
+namespace {
+
+// Remote hosts come from the documentation ranges, so they can't clash with
+// addresses of the machine running the test:
+const uint32_t LOCAL_IP = 0x7F000001;       // 127.0.0.1
+const uint32_t NAT_IP = 0xCB007163;         // 203.0.113.99, not one of ours
+const uint32_t FIRST_REMOTE_IP = 0xC6336401; // 198.51.100.1
+const size_t REMOTE_HOST_COUNT = 8;
+const size_t PORT_COUNT = 64;
+
+// A connection as the reference model keeps it. Addresses and ports are in
+// host byte order:
+struct ModelConnection
+{
+    enum Direction { OUTBOUND, INBOUND, DNAT };
+
+    Direction direction;
+    uint32_t remote_ip;
+    uint16_t local_port;
+    bool has_state;
+    uint8_t tcp_state;
+
+    // Identifies the connection's original/reply tuple:
+    tuple<int, uint32_t, uint16_t> key() const { return make_tuple(this->direction, this->remote_ip, this->local_port); }
+
+    // Outbound connections go to port 443 of the remote host, inbound ones
+    // come from a client port:
+    uint16_t remotePort() const { return (this->direction == OUTBOUND) ? 443 : this->local_port + 30000; }
+
+    string remoteHost() const
+    {
+        return to_string(this->remote_ip >> 24) + "." + to_string((this->remote_ip >> 16) & 0xFF) + "." +
+               to_string((this->remote_ip >> 8) & 0xFF) + "." + to_string(this->remote_ip & 0xFF) + ":" +
+               to_string(this->remotePort());
+    }
+};
+
+// Connections with a state, by remote host and ConnectionState:
+typedef map<string, array<uint32_t, 4>> ModelCounts;
+
+ConnectionState toConnectionState(uint8_t tcp_state)
+{
+    switch (tcp_state)
+    {
+        case TCP_CONNTRACK_SYN_SENT:
+        case TCP_CONNTRACK_SYN_RECV:
+            return ConnectionState::OPENING;
+        case TCP_CONNTRACK_ESTABLISHED:
+            return ConnectionState::OPEN;
+        case TCP_CONNTRACK_FIN_WAIT:
+        case TCP_CONNTRACK_TIME_WAIT:
+            return ConnectionState::CLOSING;
+        default:
+            return ConnectionState::CLOSED;
+    }
+}
+
+// Builds the conntrack object the kernel would report for a connection.
+// DNAT connections arrive for NAT_IP and are rewritten to LOCAL_IP, so only
+// the reply tuple names a local address:
+nf_conntrack* makeConntrack(const ModelConnection& model)
+{
+    uint32_t remote_ip = htonl(model.remote_ip);
+    uint16_t remote_port = htons(model.remotePort());
+    uint16_t local_port = htons(model.local_port);
+    uint32_t local_ip = htonl(LOCAL_IP);
+
+    nf_conntrack* ct = nfct_new();
+    nfct_set_attr_u8(ct, ATTR_L3PROTO, AF_INET);
+    nfct_set_attr_u8(ct, ATTR_L4PROTO, IPPROTO_TCP);
+    if (model.direction == ModelConnection::OUTBOUND)
+    {
+        nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_SRC, local_ip);
+        nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_DST, remote_ip);
+        nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, local_port);
+        nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, remote_port);
+    }
+    else
+    {
+        nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_SRC, remote_ip);
+        nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_DST, (model.direction == ModelConnection::DNAT) ? htonl(NAT_IP) : local_ip);
+        nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, remote_port);
+        nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, local_port);
+    }
+    nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC, nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_DST));
+    nfct_set_attr_u32(ct, ATTR_REPL_IPV4_DST, nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_SRC));
+    if (model.direction == ModelConnection::DNAT)
+        nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC, local_ip);
+    nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC, nfct_get_attr_u16(ct, ATTR_ORIG_PORT_DST));
+    nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST, nfct_get_attr_u16(ct, ATTR_ORIG_PORT_SRC));
+    if (model.has_state)
+        nfct_set_attr_u8(ct, ATTR_TCP_STATE, model.tcp_state);
+    return ct;
+}
+
+ModelConnection randomConnection(mt19937& random)
+{
+    static const uint8_t TCP_STATES[] = {
+        TCP_CONNTRACK_SYN_SENT, TCP_CONNTRACK_SYN_RECV, TCP_CONNTRACK_ESTABLISHED,
+        TCP_CONNTRACK_FIN_WAIT, TCP_CONNTRACK_TIME_WAIT, TCP_CONNTRACK_CLOSE
+    };
+
+    ModelConnection model;
+    model.direction = static_cast<ModelConnection::Direction>(random() % 3);
+    model.remote_ip = FIRST_REMOTE_IP + random() % REMOTE_HOST_COUNT;
+    model.local_port = 1024 + random() % PORT_COUNT;
+    model.has_state = (random() % 10) != 0;
+    model.tcp_state = TCP_STATES[random() % (sizeof(TCP_STATES) / sizeof(TCP_STATES[0]))];
+    return model;
+}
+
+// Applies an event to the model with the table's list semantics: NEW and
+// UPDATE leave the connection in the list with its latest state, DESTROY
+// removes it, and events for unknown connections are taken at face value.
+void applyToModel(list<ModelConnection>& model, enum nf_conntrack_msg_type type, const ModelConnection& event)
+{
+    auto existing = find_if(model.begin(), model.end(), [&](const ModelConnection& c) { return c.key() == event.key(); });
+    if (type == NFCT_T_DESTROY)
+    {
+        if (existing != model.end())
+            model.erase(existing);
+    }
+    else if (existing != model.end())
+        *existing = event;
+    else
+        model.push_back(event);
+}
+
+ModelCounts countModel(const list<ModelConnection>& model)
+{
+    ModelCounts counts;
+    for (auto& connection : model)
+    {
+        if (connection.has_state)
+            counts[connection.remoteHost()][static_cast<size_t>(toConnectionState(connection.tcp_state))]++;
+    }
+    return counts;
+}
+
+bool check(bool condition, const string& what, size_t step)
+{
+    if (!condition)
+        cerr << "FAILED at event " << step << ": " << what << endl;
+    return condition;
+}
+
+bool checkTable(ConnectionTable& table, const list<ModelConnection>& model, size_t step)
+{
+    bool ok = check(table.getConnections().size() == model.size(), "connection count", step);
+    for (auto& expected : model)
+    {
+        auto ct = makeConntrack(expected);
+        Connection connection(ct, table.getLocalAddresses());
+        nfct_destroy(ct);
+
+        auto entry = table.getConnections().find(connection.getKey());
+        if (!check(entry != nullptr, "connection missing from the table", step))
+            return false;
+        auto& stored = entry->connection;
+        ok &= check(stored.getRemoteHost() == expected.remoteHost(), "remote host of " + expected.remoteHost(), step);
+        ok &= check(stored.hasState() == expected.has_state, "connection has state", step);
+        if (expected.has_state)
+            ok &= check(stored.getState() == toConnectionState(expected.tcp_state), "connection state", step);
+    }
+
+    auto expected_counts = countModel(model);
+    ok &= check(table.getHostCount() == expected_counts.size(), "host count", step);
+
+    table.publishSnapshot();
+    auto snapshot = table.getSnapshot();
+    ok &= check(snapshot->connection_count == model.size(), "snapshot connection count", step);
+    ok &= check(snapshot->hosts.size() == expected_counts.size(), "snapshot host count", step);
+    for (auto& host : snapshot->hosts)
+    {
+        auto expected = expected_counts.find(*host.label);
+        if (!check(expected != expected_counts.end(), "unexpected host " + *host.label, step))
+            return false;
+        for (size_t state = 0; state < 4; state++)
+            ok &= check(host.counts.counts[state] == expected->second[state], "counts of host " + *host.label, step);
+    }
+    return ok;
+}
+
+bool runSequence(unsigned seed, size_t event_count)
+{
+    mt19937 random(seed);
+    ConnectionTable table;
+    table.getLocalAddresses().add(htonl(LOCAL_IP));
+    list<ModelConnection> model;
+
+    for (size_t step = 0; step < event_count; step++)
+    {
+        // Mostly events for connections the model knows about, so that
+        // sequences run through their whole lifetime, with a share of
+        // duplicate NEWs and UPDATEs or DESTROYs for unknown connections:
+        ModelConnection event = randomConnection(random);
+        if (!model.empty() && random() % 4 != 0)
+        {
+            auto existing = next(model.begin(), random() % model.size());
+            event.direction = existing->direction;
+            event.remote_ip = existing->remote_ip;
+            event.local_port = existing->local_port;
+        }
+
+        unsigned roll = random() % 10;
+        enum nf_conntrack_msg_type type = (roll < 3) ? NFCT_T_NEW : (roll < 7) ? NFCT_T_UPDATE : NFCT_T_DESTROY;
+
+        auto ct = makeConntrack(event);
+        table.processEvent(type, ct);
+        nfct_destroy(ct);
+        applyToModel(model, type, event);
+
+        if (!checkTable(table, model, step))
+        {
+            cerr << "Seed " << seed << " diverged from the reference model." << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main()
+{
+    for (unsigned seed = 1; seed <= 20; seed++)
+    {
+        if (!runSequence(seed, 2000))
+            return EXIT_FAILURE;
+    }
+
+    cout << "OK" << endl;
+    return EXIT_SUCCESS;
+}
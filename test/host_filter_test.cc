@@ -0,0 +1,224 @@
+// Checks that ignore rules given to the kernel never drop a connection the
+// table itself would track. The kernel matches rules against both
+// addresses of the original tuple, the table against the remote endpoint,
+// which for NATed and forwarded connections comes from the reply tuple.
+// Needs no privileges: the kernel filter is modelled from
+// ConnectionTable::getKernelRules(), and events are built with
+// nfct_new()/nfct_set_attr*() and fed to the table directly.
+
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "connection_table.h"
+
+using namespace std;
+using namespace conntrackex;
+
+namespace {
+
+const uint32_t LOCAL_IP = 0x7F000001;   // 127.0.0.1
+const uint32_t CLIENT_IP = 0xC0000232;  // 192.0.2.50, not ignored
+const uint32_t SERVICE_IP = 0x0A60000A; // 10.96.0.10, a ClusterIP inside an ignored range
+
+const char* const IGNORED_HOSTS[] = {"10.96.0.0/12", "198.51.100.0/28", "203.0.113.7"};
+
+// Remote addresses to pick from, in and out of the ignored ranges:
+const uint32_t REMOTE_IPS[] = {
+    0x0A60000A, 0x0A6F0001, 0x0A700001, // 10.96.0.10, 10.111.0.1, 10.112.0.1
+    0xC6336401, 0xC6336410,             // 198.51.100.1, 198.51.100.16
+    0xCB007107, 0xCB007108,             // 203.0.113.7, 203.0.113.8
+    0xC0000232                          // 192.0.2.50
+};
+
+// A connection's tuples, addresses in host byte order:
+struct Tuples
+{
+    uint32_t original_source_ip;
+    uint16_t original_source_port;
+    uint32_t original_destination_ip;
+    uint16_t original_destination_port;
+    uint32_t reply_source_ip;
+    uint16_t reply_source_port;
+    uint32_t reply_destination_ip;
+    uint16_t reply_destination_port;
+};
+
+nf_conntrack* makeConntrack(const Tuples& tuples)
+{
+    nf_conntrack* ct = nfct_new();
+    nfct_set_attr_u8(ct, ATTR_L3PROTO, AF_INET);
+    nfct_set_attr_u8(ct, ATTR_L4PROTO, IPPROTO_TCP);
+    nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_SRC, htonl(tuples.original_source_ip));
+    nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_DST, htonl(tuples.original_destination_ip));
+    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, htons(tuples.original_source_port));
+    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, htons(tuples.original_destination_port));
+    nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC, htonl(tuples.reply_source_ip));
+    nfct_set_attr_u32(ct, ATTR_REPL_IPV4_DST, htonl(tuples.reply_destination_ip));
+    nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC, htons(tuples.reply_source_port));
+    nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST, htons(tuples.reply_destination_port));
+    nfct_set_attr_u8(ct, ATTR_TCP_STATE, TCP_CONNTRACK_SYN_SENT);
+    return ct;
+}
+
+Tuples outbound(uint32_t remote_ip, uint16_t local_port)
+{
+    return {LOCAL_IP, local_port, remote_ip, 443, remote_ip, 443, LOCAL_IP, local_port};
+}
+
+Tuples inbound(uint32_t remote_ip, uint16_t remote_port)
+{
+    return {remote_ip, remote_port, LOCAL_IP, 8443, LOCAL_IP, 8443, remote_ip, remote_port};
+}
+
+// A client reaching a local backend through a virtual address, as with a
+// Kubernetes ClusterIP:
+Tuples dnat(uint32_t remote_ip, uint16_t remote_port, uint32_t virtual_ip)
+{
+    return {remote_ip, remote_port, virtual_ip, 443, LOCAL_IP, 8443, remote_ip, remote_port};
+}
+
+// Traffic routed through this host from a client it masquerades for:
+Tuples forwarded(uint32_t client_ip, uint16_t client_port, uint32_t remote_ip)
+{
+    return {client_ip, client_port, remote_ip, 443, remote_ip, 443, LOCAL_IP, client_port};
+}
+
+// What the kernel filter does with the rules: drop the event if either
+// address of the original tuple matches one of them.
+bool isDroppedByKernel(const vector<IgnoreRule>& kernel_rules, const Tuples& tuples)
+{
+    Endpoint source, destination;
+    source.ip = htonl(tuples.original_source_ip);
+    destination.ip = htonl(tuples.original_destination_ip);
+    for (auto& rule : kernel_rules)
+    {
+        if (rule.matches(source) || rule.matches(destination))
+            return true;
+    }
+    return false;
+}
+
+// Whether the table tracks a NEW connection with these tuples. The
+// connection is destroyed again afterwards:
+bool isTracked(ConnectionTable& table, const Tuples& tuples)
+{
+    auto ct = makeConntrack(tuples);
+    table.processEvent(NFCT_T_NEW, ct);
+    Connection connection(ct, table.getLocalAddresses());
+    bool tracked = (table.getConnections().find(connection.getKey()) != nullptr);
+    table.processEvent(NFCT_T_DESTROY, ct);
+    nfct_destroy(ct);
+    return tracked;
+}
+
+bool check(bool condition, const string& what)
+{
+    if (!condition)
+        cerr << "FAILED: " << what << endl;
+    return condition;
+}
+
+// Every connection the kernel would drop must be one the table ignores:
+bool checkAgreement(ConnectionTable& table, const Tuples& tuples, const string& what)
+{
+    bool dropped = isDroppedByKernel(table.getKernelRules(), tuples);
+    return check(!dropped || !isTracked(table, tuples), what + " dropped by the kernel but tracked by the table");
+}
+
+void setUp(ConnectionTable& table)
+{
+    table.getLocalAddresses().add(htonl(LOCAL_IP));
+    for (auto host : IGNORED_HOSTS)
+        table.addIgnoredHost(host);
+}
+
+// Without NAT the kernel gets every rule, and drops exactly what the
+// table ignores.
+bool testPlainConnections()
+{
+    ConnectionTable table;
+    setUp(table);
+    table.beginDump(false);
+    auto ct = makeConntrack(outbound(CLIENT_IP, 40000));
+    table.processDumpEntry(ct);
+    nfct_destroy(ct);
+    table.endDump(true);
+
+    bool ok = check(table.getKernelRules().size() == 3, "all rules go to the kernel without NAT");
+
+    mt19937 random(1);
+    for (size_t i = 0; i < 1000; i++)
+    {
+        uint32_t remote_ip = REMOTE_IPS[random() % (sizeof(REMOTE_IPS) / sizeof(REMOTE_IPS[0]))];
+        uint16_t port = 1024 + random() % 60000;
+        Tuples tuples = (random() % 2) ? outbound(remote_ip, port) : inbound(remote_ip, port);
+        bool dropped = isDroppedByKernel(table.getKernelRules(), tuples);
+        ok &= check(dropped == !isTracked(table, tuples), "kernel and table disagree on a plain connection");
+    }
+    return ok;
+}
+
+// A NATed connection in the dump keeps the rules out of the kernel, and
+// NATed connections are matched by their remote endpoint alone.
+bool testNatInDump()
+{
+    ConnectionTable table;
+    setUp(table);
+    table.beginDump(false);
+    auto ct = makeConntrack(dnat(CLIENT_IP, 50000, SERVICE_IP));
+    table.processDumpEntry(ct);
+    nfct_destroy(ct);
+    table.endDump(true);
+
+    bool ok = check(table.getKernelRules().empty(), "no rules go to the kernel with NAT");
+    ok &= check(isTracked(table, dnat(CLIENT_IP, 50001, SERVICE_IP)), "client of an ignored ClusterIP is tracked");
+    ok &= check(!isTracked(table, dnat(0xCB007107, 50002, CLIENT_IP)), "ignored client of a service is ignored");
+    return ok;
+}
+
+// A NATed connection turning up later takes the rules back out of the
+// kernel, so from then on the kernel drops nothing the table would track.
+bool testNatLater()
+{
+    ConnectionTable table;
+    setUp(table);
+    table.beginDump(false);
+    table.endDump(true);
+
+    const Tuples cluster_ip = dnat(CLIENT_IP, 50000, SERVICE_IP);
+    bool ok = check(isDroppedByKernel(table.getKernelRules(), cluster_ip), "the rules would drop a ClusterIP connection");
+    ok &= check(isTracked(table, cluster_ip), "client of an ignored ClusterIP is tracked");
+    ok &= check(table.getKernelRules().empty(), "rules are taken out of the kernel after NAT shows up");
+
+    mt19937 random(2);
+    for (size_t i = 0; i < 1000; i++)
+    {
+        uint32_t remote_ip = REMOTE_IPS[random() % (sizeof(REMOTE_IPS) / sizeof(REMOTE_IPS[0]))];
+        uint32_t other_ip = REMOTE_IPS[random() % (sizeof(REMOTE_IPS) / sizeof(REMOTE_IPS[0]))];
+        uint16_t port = 1024 + random() % 60000;
+        switch (random() % 4)
+        {
+            case 0: ok &= checkAgreement(table, outbound(remote_ip, port), "outbound connection"); break;
+            case 1: ok &= checkAgreement(table, inbound(remote_ip, port), "inbound connection"); break;
+            case 2: ok &= checkAgreement(table, dnat(remote_ip, port, other_ip), "DNAT connection"); break;
+            case 3: ok &= checkAgreement(table, forwarded(other_ip, port, remote_ip), "forwarded connection"); break;
+        }
+    }
+    return ok;
+}
+
+} // namespace
+
+int main()
+{
+    bool ok = testPlainConnections();
+    ok &= testNatInDump();
+    ok &= testNatLater();
+    if (!ok)
+        return EXIT_FAILURE;
+
+    cout << "OK" << endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,287 @@
+// Feeds ConnectionTable the event shapes the kernel actually sends and
+// checks the per-host totals built from them: counters (nf_conntrack_acct)
+// and timestamps (nf_conntrack_timestamp) only come with dump entries and
+// DESTROY events, never with NEW or UPDATE.
+// Needs no privileges: events are built with nfct_new()/nfct_set_attr*()
+// and fed to the table directly.
+
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <time.h>
+
+#include "connection_table.h"
+
+using namespace std;
+using namespace conntrackex;
+
+namespace {
+
+const uint32_t LOCAL_IP = 0x7F000001; // 127.0.0.1
+
+// Traffic counters as conntrack reports them, in the original (local to
+// remote, for the outbound connections used here) and reply directions:
+struct Counters
+{
+    uint64_t original_bytes;
+    uint64_t original_packets;
+    uint64_t reply_bytes;
+    uint64_t reply_packets;
+};
+
+// An outbound connection from LOCAL_IP to port 443 of the given remote
+// address, in host byte order:
+nf_conntrack* makeConntrack(uint32_t remote_ip, uint16_t local_port, uint8_t tcp_state)
+{
+    nf_conntrack* ct = nfct_new();
+    nfct_set_attr_u8(ct, ATTR_L3PROTO, AF_INET);
+    nfct_set_attr_u8(ct, ATTR_L4PROTO, IPPROTO_TCP);
+    nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_SRC, htonl(LOCAL_IP));
+    nfct_set_attr_u32(ct, ATTR_ORIG_IPV4_DST, htonl(remote_ip));
+    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_SRC, htons(local_port));
+    nfct_set_attr_u16(ct, ATTR_ORIG_PORT_DST, htons(443));
+    nfct_set_attr_u32(ct, ATTR_REPL_IPV4_SRC, htonl(remote_ip));
+    nfct_set_attr_u32(ct, ATTR_REPL_IPV4_DST, htonl(LOCAL_IP));
+    nfct_set_attr_u16(ct, ATTR_REPL_PORT_SRC, htons(443));
+    nfct_set_attr_u16(ct, ATTR_REPL_PORT_DST, htons(local_port));
+    nfct_set_attr_u8(ct, ATTR_TCP_STATE, tcp_state);
+    return ct;
+}
+
+void setCounters(nf_conntrack* ct, const Counters& counters)
+{
+    nfct_set_attr_u64(ct, ATTR_ORIG_COUNTER_BYTES, counters.original_bytes);
+    nfct_set_attr_u64(ct, ATTR_ORIG_COUNTER_PACKETS, counters.original_packets);
+    nfct_set_attr_u64(ct, ATTR_REPL_COUNTER_BYTES, counters.reply_bytes);
+    nfct_set_attr_u64(ct, ATTR_REPL_COUNTER_PACKETS, counters.reply_packets);
+}
+
+// Builds events with the attributes the kernel sends along and feeds them
+// to the table:
+class EventFeed
+{
+public:
+
+    explicit EventFeed(ConnectionTable& table) : table(table) {}
+
+    void event(enum nf_conntrack_msg_type type, uint32_t remote_ip, uint16_t local_port, uint8_t tcp_state)
+    {
+        auto ct = makeConntrack(remote_ip, local_port, tcp_state);
+        this->table.processEvent(type, ct);
+        nfct_destroy(ct);
+    }
+
+    // Timestamps are in nanoseconds since the epoch; leave them at 0 for a
+    // kernel that doesn't timestamp connections:
+    void destroy(uint32_t remote_ip, uint16_t local_port, const Counters& counters, uint64_t start_time = 0, uint64_t stop_time = 0)
+    {
+        auto ct = makeConntrack(remote_ip, local_port, TCP_CONNTRACK_TIME_WAIT);
+        setCounters(ct, counters);
+        if (start_time)
+        {
+            nfct_set_attr_u64(ct, ATTR_TIMESTAMP_START, start_time);
+            nfct_set_attr_u64(ct, ATTR_TIMESTAMP_STOP, stop_time);
+        }
+        this->table.processEvent(NFCT_T_DESTROY, ct);
+        nfct_destroy(ct);
+    }
+
+    void dumpEntry(uint32_t remote_ip, uint16_t local_port, uint8_t tcp_state, const Counters& counters, uint64_t start_time = 0)
+    {
+        auto ct = makeConntrack(remote_ip, local_port, tcp_state);
+        setCounters(ct, counters);
+        if (start_time)
+            nfct_set_attr_u64(ct, ATTR_TIMESTAMP_START, start_time);
+        this->table.processDumpEntry(ct);
+        nfct_destroy(ct);
+    }
+
+private:
+
+    ConnectionTable& table;
+};
+
+bool check(bool condition, const string& what)
+{
+    if (!condition)
+        cerr << "FAILED: " << what << endl;
+    return condition;
+}
+
+// The published totals of a remote host, given as "a.b.c.d:port":
+const HostTotals* findTotals(const TableSnapshot& snapshot, const string& remote_host)
+{
+    for (auto& page : snapshot.host_totals)
+    {
+        for (auto& totals : *page)
+        {
+            if (*totals.label == remote_host)
+                return &totals.totals;
+        }
+    }
+    return nullptr;
+}
+
+uint64_t getRealTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+bool checkTraffic(ConnectionTable& table, const string& remote_host, const Counters& expected)
+{
+    table.publishSnapshot();
+    auto totals = findTotals(*table.getSnapshot(), remote_host);
+    if (!check(totals != nullptr, "no totals for " + remote_host))
+        return false;
+
+    bool ok = check(totals->sent_bytes == expected.original_bytes, "bytes sent to " + remote_host);
+    ok &= check(totals->sent_packets == expected.original_packets, "packets sent to " + remote_host);
+    ok &= check(totals->received_bytes == expected.reply_bytes, "bytes received from " + remote_host);
+    ok &= check(totals->received_packets == expected.reply_packets, "packets received from " + remote_host);
+    return ok;
+}
+
+// A connection that predates the exporter: the initial dump only sets the
+// baseline, so its DESTROY adds what was exchanged after the dump.
+bool testDumpedConnection()
+{
+    ConnectionTable table;
+    table.getLocalAddresses().add(htonl(LOCAL_IP));
+    EventFeed feed(table);
+
+    table.beginDump(false);
+    feed.dumpEntry(0xC6336401, 40000, TCP_CONNTRACK_ESTABLISHED, {1000, 10, 4000, 8});
+    table.endDump(true);
+
+    feed.event(NFCT_T_UPDATE, 0xC6336401, 40000, TCP_CONNTRACK_FIN_WAIT);
+    feed.event(NFCT_T_UPDATE, 0xC6336401, 40000, TCP_CONNTRACK_TIME_WAIT);
+    feed.destroy(0xC6336401, 40000, {1500, 15, 6000, 12});
+    return checkTraffic(table, "198.51.100.1:443", {500, 5, 2000, 4});
+}
+
+// A connection opened while the exporter runs: nothing is known about its
+// traffic until its DESTROY.
+bool testLiveConnection()
+{
+    ConnectionTable table;
+    table.getLocalAddresses().add(htonl(LOCAL_IP));
+    EventFeed feed(table);
+
+    feed.event(NFCT_T_NEW, 0xC6336402, 40001, TCP_CONNTRACK_SYN_SENT);
+    feed.event(NFCT_T_UPDATE, 0xC6336402, 40001, TCP_CONNTRACK_ESTABLISHED);
+    feed.event(NFCT_T_UPDATE, 0xC6336402, 40001, TCP_CONNTRACK_FIN_WAIT);
+    feed.destroy(0xC6336402, 40001, {700, 7, 300, 3});
+    return checkTraffic(table, "198.51.100.2:443", {700, 7, 300, 3});
+}
+
+// A resync counts the traffic up to its dump, and the DESTROY that
+// follows only the rest.
+bool testResyncedConnection()
+{
+    ConnectionTable table;
+    table.getLocalAddresses().add(htonl(LOCAL_IP));
+    EventFeed feed(table);
+
+    feed.event(NFCT_T_NEW, 0xC6336403, 40002, TCP_CONNTRACK_SYN_SENT);
+    feed.event(NFCT_T_UPDATE, 0xC6336403, 40002, TCP_CONNTRACK_ESTABLISHED);
+
+    table.beginDump(true);
+    feed.dumpEntry(0xC6336403, 40002, TCP_CONNTRACK_ESTABLISHED, {200, 2, 100, 1});
+    table.endDump(true);
+    if (!checkTraffic(table, "198.51.100.3:443", {200, 2, 100, 1}))
+        return false;
+
+    feed.event(NFCT_T_UPDATE, 0xC6336403, 40002, TCP_CONNTRACK_FIN_WAIT);
+    feed.destroy(0xC6336403, 40002, {250, 3, 400, 4});
+    return checkTraffic(table, "198.51.100.3:443", {250, 3, 400, 4});
+}
+
+// Without kernel timestamps, a connection seen from its NEW event on is
+// timed from that event to the update that establishes it.
+bool testLiveOpeningTime()
+{
+    ConnectionTable table;
+    table.getLocalAddresses().add(htonl(LOCAL_IP));
+    EventFeed feed(table);
+
+    feed.event(NFCT_T_NEW, 0xC6336404, 40003, TCP_CONNTRACK_SYN_SENT);
+    feed.event(NFCT_T_UPDATE, 0xC6336404, 40003, TCP_CONNTRACK_SYN_RECV);
+    feed.event(NFCT_T_UPDATE, 0xC6336404, 40003, TCP_CONNTRACK_ESTABLISHED);
+    feed.destroy(0xC6336404, 40003, {100, 1, 100, 1});
+
+    table.publishSnapshot();
+    auto totals = findTotals(*table.getSnapshot(), "198.51.100.4:443");
+    if (!check(totals != nullptr, "no totals for a live connection"))
+        return false;
+
+    bool ok = check(totals->opening_times.getCount() == 1, "opening time of a live connection");
+    ok &= check(totals->opening_times.sum < 1, "opening time of a live connection is from its NEW event");
+    ok &= check(totals->durations.getCount() == 0, "duration without kernel timestamps");
+    return ok;
+}
+
+// A connection dumped while opening is timed from the kernel's timestamp,
+// and its duration comes from the timestamps of its DESTROY.
+bool testDumpedOpeningTime()
+{
+    ConnectionTable table;
+    table.getLocalAddresses().add(htonl(LOCAL_IP));
+    EventFeed feed(table);
+
+    uint64_t start_time = getRealTime() - 2000000000ULL;
+    table.beginDump(false);
+    feed.dumpEntry(0xC6336405, 40004, TCP_CONNTRACK_SYN_SENT, {0, 1, 0, 0}, start_time);
+    table.endDump(true);
+
+    feed.event(NFCT_T_UPDATE, 0xC6336405, 40004, TCP_CONNTRACK_ESTABLISHED);
+    feed.event(NFCT_T_UPDATE, 0xC6336405, 40004, TCP_CONNTRACK_FIN_WAIT);
+    feed.destroy(0xC6336405, 40004, {100, 2, 100, 1}, start_time, start_time + 7000000000ULL);
+
+    table.publishSnapshot();
+    auto totals = findTotals(*table.getSnapshot(), "198.51.100.5:443");
+    if (!check(totals != nullptr, "no totals for a dumped connection"))
+        return false;
+
+    bool ok = check(totals->opening_times.getCount() == 1, "opening time of a dumped connection");
+    ok &= check(totals->opening_times.sum >= 2, "opening time of a dumped connection is from its kernel timestamp");
+    ok &= check(totals->durations.getCount() == 1 && totals->durations.sum == 7, "duration from the DESTROY timestamps");
+    return ok;
+}
+
+// A connection first heard of through an update has no known start, so
+// it gets no opening time.
+bool testUnknownStart()
+{
+    ConnectionTable table;
+    table.getLocalAddresses().add(htonl(LOCAL_IP));
+    EventFeed feed(table);
+
+    feed.event(NFCT_T_UPDATE, 0xC6336406, 40005, TCP_CONNTRACK_SYN_RECV);
+    feed.event(NFCT_T_UPDATE, 0xC6336406, 40005, TCP_CONNTRACK_ESTABLISHED);
+
+    table.publishSnapshot();
+    auto totals = findTotals(*table.getSnapshot(), "198.51.100.6:443");
+    return check(totals == nullptr || totals->opening_times.getCount() == 0, "opening time without a known start");
+}
+
+} // namespace
+
+int main()
+{
+    const function<bool()> tests[] = {
+        testDumpedConnection, testLiveConnection, testResyncedConnection,
+        testLiveOpeningTime, testDumpedOpeningTime, testUnknownStart
+    };
+    bool ok = true;
+    for (auto& test : tests)
+        ok &= test();
+
+    if (!ok)
+        return EXIT_FAILURE;
+
+    cout << "OK" << endl;
+    return EXIT_SUCCESS;
+}